@@ -0,0 +1,157 @@
+#include "codememory.h"
+
+using namespace std;
+using namespace llvm;
+
+static const unsigned rw = sys::Memory::MF_READ | sys::Memory::MF_WRITE;
+static const unsigned rx = sys::Memory::MF_READ | sys::Memory::MF_EXEC;
+
+CodeMemory::~CodeMemory() {
+  for (auto &unit : units_) {
+    release(unit);
+  }
+}
+
+void CodeMemory::reserveAllocationSpace(uintptr_t code_size,
+                                        uint32_t code_align,
+                                        uintptr_t rodata_size,
+                                        uint32_t rodata_align,
+                                        uintptr_t rwdata_size,
+                                        uint32_t rwdata_align) {
+  units_.push_back(Unit { {}, {}, false });
+  auto reserve = [this](uintptr_t size, uint32_t align, unsigned flags) {
+    if (size > 0) {
+      allocate(size + align, 1, flags);
+      units_.back().blocks.back().used = 0;
+    }
+  };
+  reserve(code_size, code_align, rx);
+  reserve(rodata_size, rodata_align, sys::Memory::MF_READ);
+  reserve(rwdata_size, rwdata_align, rw);
+}
+
+// allocate from the blocks of the current object file, or from a new
+// block if the reserved space runs out
+uint8_t *CodeMemory::allocate(uintptr_t size, unsigned alignment,
+                              unsigned flags) {
+  if (units_.empty()) {
+    units_.push_back(Unit { {}, {}, false });
+  }
+  auto &unit = units_.back();
+  if (alignment == 0) {
+    alignment = 16;
+  }
+  for (auto &block : unit.blocks) {
+    if (block.flags != flags) {
+      continue;
+    }
+    // the blocks are page-aligned
+    size_t offset = alignTo(block.used, alignment);
+    if (offset + size <= block.memory.allocatedSize()) {
+      block.used = offset + size;
+      return (uint8_t *) block.memory.base() + offset;
+    }
+  }
+  std::error_code ec;
+  auto memory = sys::Memory::allocateMappedMemory(
+    size + alignment, nullptr, rw, ec);
+  if (ec) {
+    return nullptr;
+  }
+  unit.blocks.push_back(Block { memory, flags, 0 });
+  auto &block = unit.blocks.back();
+  size_t offset = alignTo((uintptr_t) memory.base(), alignment) -
+    (uintptr_t) memory.base();
+  block.used = offset + size;
+  return (uint8_t *) memory.base() + offset;
+}
+
+uint8_t *CodeMemory::allocateCodeSection(uintptr_t size, unsigned alignment,
+                                         unsigned section_id,
+                                         StringRef section_name) {
+  return allocate(size, alignment, rx);
+}
+
+uint8_t *CodeMemory::allocateDataSection(uintptr_t size, unsigned alignment,
+                                         unsigned section_id,
+                                         StringRef section_name,
+                                         bool read_only) {
+  // relocations are applied to read-only data too, so it is protected
+  // only when finalized
+  return allocate(size, alignment, read_only ? sys::Memory::MF_READ : rw);
+}
+
+void CodeMemory::registerEHFrames(uint8_t *addr, uint64_t load_addr,
+                                  size_t size) {
+  registerEHFramesInProcess(addr, size);
+  auto it = find((uint64_t) addr);
+  if (it != units_.end()) {
+    it->eh_frames.push_back({ addr, size });
+  }
+}
+
+void CodeMemory::deregisterEHFrames() {
+  for (auto &unit : units_) {
+    for (auto &frame : unit.eh_frames) {
+      deregisterEHFramesInProcess(frame.first, frame.second);
+    }
+    unit.eh_frames.clear();
+  }
+}
+
+bool CodeMemory::finalizeMemory(std::string *error) {
+  for (auto &unit : units_) {
+    if (unit.finalized) {
+      continue;
+    }
+    for (auto &block : unit.blocks) {
+      if (block.flags == rw) {
+        continue;
+      }
+      auto ec = sys::Memory::protectMappedMemory(block.memory, block.flags);
+      if (ec) {
+        if (error) {
+          *error = ec.message();
+        }
+        return true;
+      }
+      if (block.flags & sys::Memory::MF_EXEC) {
+        sys::Memory::InvalidateInstructionCache(block.memory.base(),
+                                                block.memory.allocatedSize());
+      }
+    }
+    unit.finalized = true;
+  }
+  return false;
+}
+
+list<CodeMemory::Unit>::iterator CodeMemory::find(uint64_t addr) {
+  for (auto it = units_.begin(); it != units_.end(); ++it) {
+    for (auto &block : it->blocks) {
+      auto base = (uint64_t) block.memory.base();
+      if (addr >= base && addr < base + block.memory.allocatedSize()) {
+        return it;
+      }
+    }
+  }
+  return units_.end();
+}
+
+void CodeMemory::release(Unit &unit) {
+  for (auto &frame : unit.eh_frames) {
+    deregisterEHFramesInProcess(frame.first, frame.second);
+  }
+  unit.eh_frames.clear();
+  for (auto &block : unit.blocks) {
+    sys::Memory::releaseMappedMemory(block.memory);
+  }
+  unit.blocks.clear();
+}
+
+void CodeMemory::release(uint64_t addr) {
+  auto it = find(addr);
+  if (it != units_.end()) {
+    release(*it);
+    units_.erase(it);
+  }
+}
@@ -0,0 +1,61 @@
+#include <list>
+#include <vector>
+
+#include <llvm/ExecutionEngine/RTDyldMemoryManager.h>
+#include <llvm/Support/Memory.h>
+
+using namespace std;
+using namespace llvm;
+
+// the memory manager of the JIT
+//
+// the code and data of each object file compiled by the JIT get memory
+// blocks of their own, so they can be released when the code is not
+// used any more (SectionMemoryManager only releases everything at
+// once)
+class CodeMemory : public RTDyldMemoryManager {
+  struct Block {
+    sys::MemoryBlock memory;
+    // the protection after finalization
+    unsigned flags;
+    size_t used;
+  };
+
+  struct Unit {
+    vector<Block> blocks;
+    vector<pair<uint8_t *, size_t>> eh_frames;
+    bool finalized;
+  };
+
+  list<Unit> units_;
+
+  uint8_t *allocate(uintptr_t size, unsigned alignment, unsigned flags);
+  list<Unit>::iterator find(uint64_t addr);
+  void release(Unit &unit);
+
+public:
+  CodeMemory() = default;
+  ~CodeMemory() override;
+  CodeMemory(const CodeMemory &) = delete;
+  CodeMemory &operator=(const CodeMemory &) = delete;
+
+  bool needsToReserveAllocationSpace() override { return true; }
+  // called before the sections of each object file are allocated
+  void reserveAllocationSpace(uintptr_t code_size, uint32_t code_align,
+                              uintptr_t rodata_size, uint32_t rodata_align,
+                              uintptr_t rwdata_size,
+                              uint32_t rwdata_align) override;
+  uint8_t *allocateCodeSection(uintptr_t size, unsigned alignment,
+                               unsigned section_id,
+                               StringRef section_name) override;
+  uint8_t *allocateDataSection(uintptr_t size, unsigned alignment,
+                               unsigned section_id, StringRef section_name,
+                               bool read_only) override;
+  void registerEHFrames(uint8_t *addr, uint64_t load_addr,
+                        size_t size) override;
+  void deregisterEHFrames() override;
+  bool finalizeMemory(std::string *error = nullptr) override;
+
+  // release the memory of the object file containing address addr
+  void release(uint64_t addr);
+};
@@ -1,32 +1,109 @@
+#include <atomic>
 #include <iostream>
+#include <limits>
 #include <fstream>
+#include <set>
+#include <sstream>
 
 #include <llvm/ADT/SmallVector.h>
+#include <llvm/ADT/StringExtras.h>
 #include <llvm/Support/Error.h>
 #include <llvm/Support/MemoryBuffer.h>
 #include <llvm/Support/raw_ostream.h>
 #include <llvm/Support/SourceMgr.h>
 #include <llvm/Support/DynamicLibrary.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/MD5.h>
+#include <llvm/Support/SHA256.h>
+#include <llvm/Support/SmallVectorMemoryBuffer.h>
 #include <llvm/AsmParser/Parser.h>
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/InstIterator.h>
 #include <llvm/IR/LLVMContext.h>
 #include <llvm/IR/Module.h>
+#include <llvm/IR/ModuleSlotTracker.h>
 #include <llvm/IR/Verifier.h>
 #include <llvm/IRReader/IRReader.h>
 #include <llvm/Linker/Linker.h>
+#include <llvm/Bitcode/BitcodeReader.h>
 #include <llvm/Bitcode/BitcodeWriter.h>
 #include <llvm/ExecutionEngine/ExecutionEngine.h>
+#include <llvm/ExecutionEngine/GenericValue.h>
+#include <llvm/ExecutionEngine/Interpreter.h>
+#include <llvm/Passes/PassBuilder.h>
+#include <llvm/Target/TargetMachine.h>
+#include <llvm/Transforms/Utils/Cloning.h>
 
+#include "codememory.h"
 #include "compiler.h"
+#include "library.h"
+#include "threadpool.h"
 
 using namespace std;
 using namespace llvm;
 
-CompileContext::CompileContext() {
+Buffer::Buffer(size_t size) : size_(size) {
+  std::error_code ec;
+  block_ = sys::Memory::allocateMappedMemory(
+    size, nullptr, sys::Memory::MF_READ | sys::Memory::MF_WRITE, ec);
+  if (ec) {
+    throw std::invalid_argument("cannot allocate buffer: " + ec.message());
+  }
+}
+
+Buffer::~Buffer() {
+  sys::Memory::releaseMappedMemory(block_);
+}
+
+// the results of pure calls are cached up to this many bytes
+static const size_t call_cache_limit = 64 << 20;
+
+void CallCache::erase(list<Entry>::iterator it) {
+  size_ -= it->key.size() + it->result.size();
+  index_.erase(it->key);
+  entries_.erase(it);
+}
+
+const ByteArray *CallCache::get(const string &key) {
+  auto it = index_.find(key);
+  if (it == index_.end()) {
+    return nullptr;
+  }
+  entries_.splice(entries_.begin(), entries_, it->second);
+  return &it->second->result;
+}
+
+void CallCache::put(const string &key, const ByteArray &result) {
+  size_t size = key.size() + result.size();
+  if (size > limit_ || index_.count(key)) {
+    return;
+  }
+  while (size_ + size > limit_) {
+    erase(std::prev(entries_.end()));
+  }
+  entries_.push_front(Entry { key, result });
+  index_[entries_.front().key] = entries_.begin();
+  size_ += size;
+}
+
+void CallCache::clear() {
+  entries_.clear();
+  index_.clear();
+  size_ = 0;
+}
+
+CompileContext::CompileContext(const string &cache_dir,
+                               const Library *library)
+  : parsed_size_(0), cache_dir_(cache_dir), library_(library),
+    epochs_(std::make_unique<Epochs>()), cache_(call_cache_limit) {
   auto mod = std::make_unique<Module>("empty", ctx_);
   EngineBuilder builder(std::move(mod));
   string ErrorMsg;
   builder.setErrorStr(&ErrorMsg);
   builder.setEngineKind(EngineKind::JIT);
+  auto code = std::make_unique<CodeMemory>();
+  code_ = code.get();
+  builder.setMCJITMemoryManager(std::move(code));
   builder.setVerifyModules(true);
   builder.setOptLevel(CodeGenOpt::Default);
   ee_ = std::unique_ptr<ExecutionEngine>(builder.create());
@@ -35,21 +112,297 @@ CompileContext::CompileContext() {
   }
 }
 
+CompileContext::~CompileContext() {
+  for (auto &it : coroutines_) {
+    destroy(it.second);
+  }
+}
+
+void CompileContext::destroy(Coroutine &co) {
+  co.frame->destroy(co.frame);
+  epochs_->leave(co.epoch);
+}
+
+// a marker for coroutines which survives their lowering
+static const char *coroutine_attr = "llvm-server.coroutine";
+
+// mark the coroutines of the module and report if any of them has to
+// be lowered
+static bool mark_coroutines(Module &mod) {
+  auto begin = mod.getFunction("llvm.coro.begin");
+  if (!begin) {
+    return false;
+  }
+  bool unsplit = false;
+  for (auto user : begin->users()) {
+    if (auto call = dyn_cast<CallInst>(user)) {
+      call->getFunction()->addFnAttr(coroutine_attr);
+      unsplit = true;
+    }
+  }
+  return unsplit;
+}
+
+static std::invalid_argument parse_error(const SMDiagnostic &err) {
+  string errmsg;
+  raw_string_ostream os(errmsg);
+  err.print(nullptr, os, false);
+  return std::invalid_argument(os.str());
+}
+
 void CompileContext::parse(const ByteArray &input) {
   StringRef code(input.begin(), input.size());
-  MemoryBufferRef buf(code, "");
+  if (isBitcode((const unsigned char *) code.begin(),
+                (const unsigned char *) code.end())) {
+    // the lazily loaded module needs a buffer of its own
+    parse(MemoryBuffer::getMemBufferCopy(code));
+  } else {
+    parse_buffer(MemoryBufferRef(code, ""));
+  }
+}
+
+// bitcode is loaded lazily: the function bodies are only read when
+// they are needed, and the module owns the buffer until then
+void CompileContext::parse(std::unique_ptr<MemoryBuffer> input) {
+  auto start = (const unsigned char *) input->getBufferStart();
+  if (!isBitcode(start, start + input->getBufferSize())) {
+    parse_buffer(input->getMemBufferRef());
+    return;
+  }
+  auto mod = getOwningLazyBitcodeModule(std::move(input), ctx_);
+  if (!mod) {
+    throw std::invalid_argument(toString(mod.takeError()));
+  }
+  stack_.push_back(std::move(*mod));
+}
+
+// the file is mapped rather than read if it is large enough
+void CompileContext::parse_file(const string &path) {
+  auto input = MemoryBuffer::getFile(path);
+  if (!input) {
+    throw std::invalid_argument(path + ": " + input.getError().message());
+  }
+  parse(std::move(*input));
+}
+
+void CompileContext::parse_many(std::unique_ptr<MemoryBuffer> input,
+                                const vector<size_t> &sizes) {
+  vector<StringRef> codes;
+  size_t offset = 0;
+  for (auto size : sizes) {
+    if (size > input->getBufferSize() - offset) {
+      throw std::invalid_argument("module sizes exceed the input");
+    }
+    codes.push_back(input->getBuffer().substr(offset, size));
+    offset += size;
+  }
+  auto is_bitcode = [](StringRef code) {
+    return isBitcode((const unsigned char *) code.begin(),
+                     (const unsigned char *) code.end());
+  };
+  // assembly is parsed in parallel, each module in a context of its
+  // own, and handed over to ctx_ as bitcode
+  vector<ByteArray> bitcodes(codes.size());
+  vector<string> errors(codes.size());
+  pool().parallel_for(codes.size(), [&](size_t i) {
+    if (is_bitcode(codes[i])) {
+      return;
+    }
+    LLVMContext ctx;
+    // the lexer needs a terminating zero
+    auto buf = MemoryBuffer::getMemBufferCopy(codes[i]);
+    SMDiagnostic err;
+    auto mod = parseIR(*buf, err, ctx);
+    if (!mod) {
+      errors[i] = parse_error(err).what();
+      return;
+    }
+    raw_svector_ostream os(bitcodes[i]);
+    WriteBitcodeToFile(*mod, os);
+  });
+  for (size_t i = 0; i < errors.size(); i++) {
+    if (!errors[i].empty()) {
+      throw std::invalid_argument("module " + to_string(i) + ": " +
+                                  errors[i]);
+    }
+  }
+  vector<std::unique_ptr<Module>> mods;
+  for (size_t i = 0; i < codes.size(); i++) {
+    std::unique_ptr<MemoryBuffer> buf;
+    if (is_bitcode(codes[i])) {
+      buf = MemoryBuffer::getMemBufferCopy(codes[i]);
+    } else {
+      buf = std::make_unique<SmallVectorMemoryBuffer>(std::move(bitcodes[i]));
+    }
+    auto mod = getOwningLazyBitcodeModule(std::move(buf), ctx_);
+    if (!mod) {
+      throw std::invalid_argument("module " + to_string(i) + ": " +
+                                  toString(mod.takeError()));
+    }
+    mods.push_back(std::move(*mod));
+  }
+  for (auto &mod : mods) {
+    stack_.push_back(std::move(mod));
+  }
+}
+
+// the bitcode of the modules parsed by PARSEHASH is kept up to this
+// many bytes
+static const size_t parsed_limit = 256 << 20;
+
+static void check_content_hash(const string &hash) {
+  if (hash.size() != 64 ||
+      hash.find_first_not_of("0123456789abcdef") != string::npos) {
+    throw std::invalid_argument("invalid content hash: " + hash);
+  }
+}
+
+string CompileContext::cache_path(const string &hash) {
+  return cache_dir_ + "/" + hash + ".bc";
+}
+
+bool CompileContext::have(const string &hash) {
+  check_content_hash(hash);
+  return parsed_.count(hash) ||
+    (!cache_dir_.empty() && sys::fs::exists(cache_path(hash)));
+}
+
+void CompileContext::parse_hash(const string &hash) {
+  check_content_hash(hash);
+  auto it = parsed_.find(hash);
+  if (it != parsed_.end()) {
+    parse(it->second);
+    return;
+  }
+  if (!cache_dir_.empty()) {
+    auto file = MemoryBuffer::getFile(cache_path(hash));
+    if (file) {
+      parse(std::move(*file));
+      return;
+    }
+  }
+  throw std::invalid_argument("unknown module: " + hash);
+}
+
+void CompileContext::parse_hash(const string &hash,
+                                std::unique_ptr<MemoryBuffer> input) {
+  check_content_hash(hash);
+  auto data = arrayRefFromStringRef(input->getBuffer());
+  auto digest = toHex(SHA256::hash(data), true);
+  if (digest != hash) {
+    throw std::invalid_argument("content hash mismatch: " + digest);
+  }
+  auto start = (const unsigned char *) input->getBufferStart();
+  if (!isBitcode(start, start + input->getBufferSize())) {
+    parse(std::move(input));
+    // keep the parsed module, which is faster to load than assembly
+    ByteArray bitcode;
+    raw_svector_ostream os(bitcode);
+    WriteBitcodeToFile(*stack_.back(), os);
+    store_parsed(hash, StringRef(bitcode.begin(), bitcode.size()));
+    return;
+  }
+  // the module takes over the buffer
+  store_parsed(hash, input->getBuffer());
+  try {
+    parse(std::move(input));
+  }
+  catch (...) {
+    forget_parsed(hash);
+    if (!cache_dir_.empty()) {
+      sys::fs::remove(cache_path(hash));
+    }
+    throw;
+  }
+}
+
+// the cache is shared by the sessions, so the files are written under
+// a temporary name and renamed when complete
+static void write_file(const string &path, StringRef data) {
+  SmallString<128> tmp;
+  int fd;
+  if (sys::fs::createUniqueFile(path + ".%%%%%%", fd, tmp)) {
+    return;
+  }
+  raw_fd_ostream os(fd, true);
+  os << data;
+  os.close();
+  if (os.has_error()) {
+    os.clear_error();
+    sys::fs::remove(tmp);
+    return;
+  }
+  sys::fs::rename(tmp, path);
+}
+
+// caching is best effort, failures are ignored
+void CompileContext::store_parsed(const string &hash, StringRef bitcode) {
+  if (!cache_dir_.empty()) {
+    write_file(cache_path(hash), bitcode);
+  }
+  if (bitcode.size() > parsed_limit || parsed_.count(hash)) {
+    return;
+  }
+  while (parsed_size_ + bitcode.size() > parsed_limit) {
+    forget_parsed(parsed_order_.front());
+  }
+  parsed_[hash] = ByteArray(bitcode.begin(), bitcode.end());
+  parsed_order_.push_back(hash);
+  parsed_size_ += bitcode.size();
+}
+
+void CompileContext::forget_parsed(const string &hash) {
+  auto it = parsed_.find(hash);
+  if (it != parsed_.end()) {
+    parsed_size_ -= it->second.size();
+    parsed_.erase(it);
+    parsed_order_.remove(hash);
+  }
+}
+
+// read the function bodies of a lazily loaded module
+static void materialize(Module &mod) {
+  if (auto err = mod.materializeAll()) {
+    throw std::invalid_argument(toString(std::move(err)));
+  }
+}
+
+void CompileContext::parse_buffer(MemoryBufferRef buf) {
   SMDiagnostic err;
   std::unique_ptr<Module> mod = parseIR(buf, err, ctx_);
   if (!mod) {
-    string errmsg;
-    raw_string_ostream os(errmsg);
-    err.print(nullptr, os, false);
-    throw std::invalid_argument(os.str());
+    throw parse_error(err);
   }
   stack_.push_back(std::move(mod));
 }
 
+void CompileContext::optimize(Module &mod, OptimizationLevel level) {
+  auto tm = ee_->getTargetMachine();
+  mod.setDataLayout(ee_->getDataLayout());
+  mod.setTargetTriple(tm->getTargetTriple().str());
+  LoopAnalysisManager lam;
+  FunctionAnalysisManager fam;
+  CGSCCAnalysisManager cgam;
+  ModuleAnalysisManager mam;
+  PassBuilder pb(tm);
+  pb.registerModuleAnalyses(mam);
+  pb.registerCGSCCAnalyses(cgam);
+  pb.registerFunctionAnalyses(fam);
+  pb.registerLoopAnalyses(lam);
+  pb.crossRegisterProxies(lam, fam, cgam, mam);
+  mark_coroutines(mod);
+  auto mpm = level == OptimizationLevel::O0
+    ? pb.buildO0DefaultPipeline(level)
+    : pb.buildPerModuleDefaultPipeline(level);
+  mpm.run(mod, mam);
+}
+
 void CompileContext::opt() {
+  if (stack_.size() < 1) {
+    throw std::underflow_error("module stack underflow");
+  }
+  materialize(*stack_.back());
+  optimize(*stack_.back());
 }
 
 ByteArray CompileContext::dump() {
@@ -57,45 +410,1605 @@ ByteArray CompileContext::dump() {
     throw std::underflow_error("module stack underflow");
   }
   auto &mod = stack_.back();
+  materialize(*mod);
   ByteArray response;
   raw_svector_ostream os(response);
   WriteBitcodeToFile(*mod, os);
   return std::move(response);
 }
 
-void CompileContext::link() {
+// the bitcode writer flushes to a seekable file as it goes, so the
+// bitcode is never held in memory as a whole; it is written to a
+// temporary file which replaces path once complete
+void CompileContext::dump_file(const string &path) {
+  if (stack_.size() < 1) {
+    throw std::underflow_error("module stack underflow");
+  }
+  materialize(*stack_.back());
+  SmallString<128> tmp;
+  int fd;
+  if (auto ec = sys::fs::createUniqueFile(path + ".%%%%%%", fd, tmp)) {
+    throw std::invalid_argument(path + ": " + ec.message());
+  }
+  sys::fs::closeFile(fd);
+  std::error_code ec;
+  {
+    raw_fd_stream os(tmp, ec);
+    if (!ec) {
+      WriteBitcodeToFile(*stack_.back(), os);
+      os.close();
+      ec = os.error();
+      os.clear_error();
+    }
+  }
+  if (!ec) {
+    ec = sys::fs::rename(tmp, path);
+  }
+  if (ec) {
+    sys::fs::remove(tmp);
+    throw std::invalid_argument(path + ": " + ec.message());
+  }
+}
+
+namespace {
+
+// sends what is written to it to a sink in chunks of the given size
+class SinkStream : public raw_ostream {
+  const Sink &sink_;
+  size_t chunk_size_;
+  uint64_t pos_;
+
+  void write_impl(const char *ptr, size_t size) override {
+    pos_ += size;
+    while (size > 0) {
+      size_t len = std::min(size, chunk_size_);
+      sink_(ptr, len);
+      ptr += len;
+      size -= len;
+    }
+  }
+
+  uint64_t current_pos() const override { return pos_; }
+
+public:
+  SinkStream(const Sink &sink, size_t chunk_size)
+    : sink_(sink), chunk_size_(chunk_size), pos_(0) {
+    SetBufferSize(chunk_size);
+  }
+
+  ~SinkStream() override { flush(); }
+};
+
+}
+
+// the bitcode writer keeps the whole bitcode in a buffer of its own
+// (unless it writes to a file), so the chunks are sent from that
+// buffer without another copy of the bitcode
+void CompileContext::dump(size_t chunk_size, const Sink &sink) {
+  if (stack_.size() < 1) {
+    throw std::underflow_error("module stack underflow");
+  }
+  if (chunk_size == 0) {
+    throw std::invalid_argument("chunk size must be positive");
+  }
+  materialize(*stack_.back());
+  SinkStream os(sink, chunk_size);
+  WriteBitcodeToFile(*stack_.back(), os);
+}
+
+void CompileContext::link(bool only_needed) {
   if (stack_.size() < 2) {
     throw std::underflow_error("module stack underflow");
   }
+  if (only_needed) {
+    // link M1 into M2 so that the linker reads only the bodies M2 needs,
+    // directly or through them, from a lazily loaded M1
+    std::swap(stack_[stack_.size() - 2], stack_.back());
+  }
+  // the linker reads the bodies it needs from a lazily loaded source
+  materialize(*stack_[stack_.size() - 2]);
   auto src = std::move(stack_.back());
   stack_.pop_back();
   auto &dest = stack_.back();
-  auto err = Linker::linkModules(*dest, std::move(src));
+  auto err = Linker::linkModules(*dest, std::move(src),
+                                 only_needed ? Linker::Flags::LinkOnlyNeeded
+                                             : Linker::Flags::None);
   if (err) {
     throw std::runtime_error("link failure");
   }
 }
 
-void CompileContext::commit() {
+static bool is_exported(const GlobalValue &gv) {
+  return !gv.isDeclaration() && !gv.hasLocalLinkage() &&
+    !gv.hasAvailableExternallyLinkage();
+}
+
+string CompileContext::commit() {
+  return commit_module(false);
+}
+
+string CompileContext::replace() {
+  return commit_module(true);
+}
+
+// a hash of the bitcode of a module
+static string module_hash(const Module &mod) {
+  ByteArray bitcode;
+  raw_svector_ostream os(bitcode);
+  WriteBitcodeToFile(mod, os);
+  MD5 md5;
+  md5.update(StringRef(bitcode.begin(), bitcode.size()));
+  MD5::MD5Result result;
+  md5.final(result);
+  return result.digest().str().str();
+}
+
+string CompileContext::commit_module(bool replace) {
   if (stack_.size() < 1) {
     throw std::underflow_error("module stack underflow");
   }
-  ee_->addModule(std::move(stack_.back()));
+  materialize(*stack_.back());
+  if (mark_coroutines(*stack_.back())) {
+    // the code generator cannot handle coroutines which have not been
+    // split by the coroutine passes
+    optimize(*stack_.back(), OptimizationLevel::O0);
+  }
+  if (!replace) {
+    drop_weak_redefinitions(*stack_.back());
+  }
+  check_redefinitions(*stack_.back(), replace);
+  // the module stays on the stack if the library cannot be loaded
+  load_library(*stack_.back());
+  auto mod = std::move(stack_.back());
   stack_.pop_back();
+  return add_source(std::move(mod));
+}
+
+// keep a copy of a committed module for PATCH, and commit it
+string CompileContext::add_source(std::unique_ptr<Module> mod) {
+  auto hash = module_hash(*mod);
+  sources_[hash] = CloneModule(*mod);
+  add_to_engine(std::move(mod));
+  return hash;
+}
+
+// commit the library modules defining the symbols which mod leaves
+// unresolved, and in turn those which they leave unresolved
+//
+// definitions of symbols which are defined already are dropped from
+// the library modules, and they are committed before mod since they
+// resolve its symbols
+void CompileContext::load_library(const Module &mod) {
+  if (!library_) {
+    return;
+  }
+  set<string> defined;
+  for (auto &gv : mod.global_values()) {
+    if (is_exported(gv)) {
+      defined.insert(gv.getName().str());
+    }
+  }
+  vector<std::unique_ptr<Module>> loaded;
+  vector<const Module *> pending = { &mod };
+  set<string> paths;
+  while (!pending.empty()) {
+    auto m = pending.back();
+    pending.pop_back();
+    for (auto &gv : m->global_values()) {
+      string name = gv.getName().str();
+      if (!gv.isDeclaration() || gv.use_empty() || defined.count(name) ||
+          find_committed_global(name)) {
+        continue;
+      }
+      auto path = library_->find(name);
+      if (!path || loaded_.count(*path) || paths.count(*path)) {
+        continue;
+      }
+      SMDiagnostic err;
+      auto lib = getLazyIRFileModule(*path, err, ctx_);
+      if (!lib) {
+        throw parse_error(err);
+      }
+      materialize(*lib);
+      if (mark_coroutines(*lib)) {
+        optimize(*lib, OptimizationLevel::O0);
+      }
+      for (auto &f : lib->functions()) {
+        if (is_exported(f) && (defined.count(f.getName().str()) ||
+                               find_committed(f.getName().str()))) {
+          f.deleteBody();
+        }
+      }
+      for (auto &v : lib->globals()) {
+        if (is_exported(v) && (defined.count(v.getName().str()) ||
+                               find_committed_global(v.getName().str()))) {
+          v.setInitializer(nullptr);
+          v.setLinkage(GlobalValue::ExternalLinkage);
+          v.setComdat(nullptr);
+        }
+      }
+      for (auto &lgv : lib->global_values()) {
+        if (is_exported(lgv)) {
+          defined.insert(lgv.getName().str());
+        }
+      }
+      paths.insert(*path);
+      pending.push_back(lib.get());
+      loaded.push_back(std::move(lib));
+    }
+  }
+  for (auto &lib : loaded) {
+    add_to_engine(std::move(lib));
+  }
+  loaded_.insert(paths.begin(), paths.end());
+}
+
+string CompileContext::watch(const string &path) {
+  SMDiagnostic err;
+  auto mod = parseIRFile(path, err, ctx_);
+  if (!mod) {
+    throw parse_error(err);
+  }
+  auto it = watched_.find(path);
+  auto depth = stack_.size();
+  stack_.push_back(std::move(mod));
+  string hash;
+  try {
+    hash = commit_module(it != watched_.end());
+  }
+  catch (...) {
+    // the module does not go through the stack of the client
+    stack_.resize(depth);
+    throw;
+  }
+  if (it != watched_.end() && it->second != hash) {
+    sources_.erase(it->second);
+  }
+  watched_[path] = hash;
+  return hash;
+}
+
+string CompileContext::patch(const string &hash,
+                             const vector<string> &removed) {
+  if (stack_.size() < 1) {
+    throw std::underflow_error("module stack underflow");
+  }
+  auto it = sources_.find(hash);
+  if (it == sources_.end()) {
+    throw std::invalid_argument("unknown module: " + hash);
+  }
+  auto mod = CloneModule(*it->second);
+  // the patch stays on the stack if it cannot be applied
+  materialize(*stack_.back());
+  auto delta = CloneModule(*stack_.back());
+  if (mark_coroutines(*delta)) {
+    optimize(*delta, OptimizationLevel::O0);
+  }
+  // the definitions of the delta override those of the module
+  if (Linker::linkModules(*mod, std::move(delta),
+                          Linker::Flags::OverrideFromSrc)) {
+    throw std::invalid_argument("cannot link the patch into " + hash);
+  }
+  for (auto &name : removed) {
+    auto gv = mod->getNamedValue(name);
+    if (!gv || gv->isDeclaration()) {
+      throw std::invalid_argument("not defined by the module: " + name);
+    }
+    // the storage of a variable stays with the code using it
+    if (!isa<Function>(gv)) {
+      throw std::invalid_argument("only functions can be removed: " + name);
+    }
+    if (!stubs_.count(name)) {
+      throw std::invalid_argument("variadic functions cannot be removed: " +
+                                  name);
+    }
+    if (!gv->use_empty()) {
+      throw std::invalid_argument("still used by the module: " + name);
+    }
+    gv->eraseFromParent();
+  }
+  check_redefinitions(*mod, true);
+  load_library(*mod);
+  stack_.pop_back();
+  sources_.erase(it);
+  auto patched = add_source(std::move(mod));
+  // the code of a removed function stays for the committed callers,
+  // but the function cannot be called by name any more and may be
+  // committed again
+  for (auto &name : removed) {
+    if (auto f = find_committed(name)) {
+      f->deleteBody();
+      f->setComdat(nullptr);
+    }
+    removed_.insert(name);
+  }
+  return patched;
+}
+
+// a local mutable variable which f (or a function it calls in the
+// same module) refers to
+static const GlobalVariable *local_state(const Function &f) {
+  set<const Value *> seen { &f };
+  vector<const User *> work { &f };
+  while (!work.empty()) {
+    auto user = work.back();
+    work.pop_back();
+    vector<const User *> users;
+    if (auto g = dyn_cast<Function>(user)) {
+      for (auto &inst : instructions(g)) {
+        users.push_back(&inst);
+      }
+    } else if (auto var = dyn_cast<GlobalVariable>(user)) {
+      if (!var->hasLocalLinkage()) {
+        continue;
+      }
+      if (!var->isConstant()) {
+        return var;
+      }
+      users.push_back(var->getInitializer());
+    } else {
+      users.push_back(user);
+    }
+    for (auto u : users) {
+      for (auto &op : u->operands()) {
+        auto c = dyn_cast<Constant>(op);
+        if (!c || !seen.insert(c).second) {
+          continue;
+        }
+        auto gv = dyn_cast<GlobalValue>(c);
+        if (gv ? !gv->isDeclaration() : !isa<ConstantData>(c)) {
+          work.push_back(c);
+        }
+      }
+    }
+  }
+  return nullptr;
+}
+
+// definitions which the linker may discard (e.g. the linkonce_odr
+// definitions of C++ inline functions and templates) are dropped if
+// the symbol is committed already, the committed one is used instead
+void CompileContext::drop_weak_redefinitions(Module &mod) {
+  for (auto &f : mod.functions()) {
+    if (is_exported(f) && f.isWeakForLinker() &&
+        find_committed_global(f.getName().str())) {
+      f.deleteBody();
+      f.setComdat(nullptr);
+    }
+  }
+  for (auto &gv : mod.globals()) {
+    if (is_exported(gv) && gv.isWeakForLinker() &&
+        find_committed_global(gv.getName().str())) {
+      gv.setInitializer(nullptr);
+      gv.setLinkage(GlobalValue::ExternalLinkage);
+      gv.setComdat(nullptr);
+    }
+  }
+}
+
+void CompileContext::check_redefinitions(const Module &mod, bool replace) {
+  for (auto &f : mod.functions()) {
+    if (!is_exported(f)) {
+      continue;
+    }
+    string name = f.getName().str();
+    auto it = stubs_.find(name);
+    if (it == stubs_.end()) {
+      if (find_committed(name)) {
+        throw std::invalid_argument("cannot redefine " + name);
+      }
+    } else if (!replace && !removed_.count(name)) {
+      throw std::invalid_argument("function already committed: " + name);
+    } else if (f.getFunctionType() != it->second.type) {
+      throw std::invalid_argument("cannot change the type of " + name);
+    }
+  }
+  // the composites inlining the replaced functions are regenerated
+  for (auto &c : composites_) {
+    for (auto &part : fused_[c.first]) {
+      auto f = mod.getFunction(part);
+      auto var = f && is_exported(*f) ? local_state(*f) : nullptr;
+      if (var) {
+        throw std::invalid_argument("cannot fuse " + part + " into " +
+                                    c.first + ": it uses the local variable " +
+                                    var->getName().str());
+      }
+    }
+  }
+  if (!replace) {
+    for (auto &gv : mod.globals()) {
+      if (is_exported(gv) && find_committed_global(gv.getName().str())) {
+        throw std::invalid_argument("global already committed: " +
+                                    gv.getName().str());
+      }
+    }
+  }
+}
+
+// route calls of function f through a stub which jumps to the address
+// stored in a slot, so the definition can be replaced later
+void CompileContext::make_stub(Function &f) {
+  string name = f.getName().str();
+  auto fty = f.getFunctionType();
+  auto mod = f.getParent();
+  auto stub = Function::Create(fty, f.getLinkage(), "", mod);
+  stub->takeName(&f);
+  stub->setAttributes(f.getAttributes());
+  stub->setCallingConv(f.getCallingConv());
+  f.replaceAllUsesWith(stub);
+  f.setName(name + ".impl.0");
+  f.setLinkage(GlobalValue::ExternalLinkage);
+  auto slot = new GlobalVariable(*mod, fty->getPointerTo(), false,
+                                 GlobalValue::ExternalLinkage, &f,
+                                 name + ".slot");
+  IRBuilder<> b(BasicBlock::Create(ctx_, "entry", stub));
+  auto target = b.CreateAlignedLoad(
+    fty->getPointerTo(), slot,
+    mod->getDataLayout().getPointerABIAlignment(0));
+  target->setAtomic(AtomicOrdering::Monotonic);
+  vector<Value *> args;
+  for (auto &arg : stub->args()) {
+    args.push_back(&arg);
+  }
+  auto call = b.CreateCall(fty, target, args);
+  call->setTailCallKind(CallInst::TCK_MustTail);
+  call->setAttributes(f.getAttributes());
+  call->setCallingConv(f.getCallingConv());
+  if (fty->getReturnType()->isVoidTy()) {
+    b.CreateRetVoid();
+  } else {
+    b.CreateRet(call);
+  }
+  stubs_[name] = Stub { name + ".slot", fty, 0, nullptr };
+}
+
+// a digest of the IR of function f and of the local functions and
+// variables it refers to (which are compiled together with f)
+//
+// references to other global values only contribute their names and
+// types, since they are resolved through their stubs
+//
+// the IR only refers to attribute groups and metadata nodes by number,
+// so their contents are added as well
+static MD5::MD5Result digest(const Function &f, ModuleSlotTracker &slots) {
+  MD5 md5;
+  set<const MDNode *> seen_nodes;
+  std::function<void(const MDNode *)> node = [&](const MDNode *md) {
+    if (!seen_nodes.insert(md).second) {
+      return;
+    }
+    string text;
+    raw_string_ostream os(text);
+    md->print(os, slots, f.getParent());
+    md5.update(os.str());
+    for (auto &op : md->operands()) {
+      if (auto child = dyn_cast_or_null<MDNode>(op.get())) {
+        node(child);
+      }
+    }
+  };
+  auto attachments = [&](const SmallVectorImpl<pair<unsigned, MDNode *>> &mds) {
+    for (auto &md : mds) {
+      md5.update(md.first);
+      node(md.second);
+    }
+  };
+  auto attributes = [&](const AttributeList &attrs) {
+    string text;
+    raw_string_ostream os(text);
+    attrs.print(os);
+    md5.update(os.str());
+  };
+  set<const GlobalValue *> seen { &f };
+  vector<const GlobalValue *> work { &f };
+  std::function<void(const User *)> refer = [&](const User *user) {
+    for (auto &op : user->operands()) {
+      if (auto gv = dyn_cast<GlobalValue>(op)) {
+        if (gv->hasLocalLinkage() && seen.insert(gv).second) {
+          work.push_back(gv);
+        }
+      } else if (auto c = dyn_cast<Constant>(op)) {
+        refer(c);
+      }
+    }
+  };
+  while (!work.empty()) {
+    auto gv = work.back();
+    work.pop_back();
+    string text;
+    raw_string_ostream os(text);
+    gv->print(os, slots);
+    md5.update(os.str());
+    SmallVector<pair<unsigned, MDNode *>, 4> mds;
+    if (auto go = dyn_cast<GlobalObject>(gv)) {
+      go->getAllMetadata(mds);
+      attachments(mds);
+    }
+    if (auto f = dyn_cast<Function>(gv)) {
+      attributes(f->getAttributes());
+      for (auto &inst : instructions(f)) {
+        refer(&inst);
+        inst.getAllMetadata(mds);
+        attachments(mds);
+        if (auto call = dyn_cast<CallBase>(&inst)) {
+          attributes(call->getAttributes());
+        }
+      }
+    } else if (auto var = dyn_cast<GlobalVariable>(gv)) {
+      if (var->hasInitializer()) {
+        refer(var->getInitializer());
+      }
+    }
+  }
+  MD5::MD5Result result;
+  md5.final(result);
+  return result;
+}
+
+// the mutable local variables which f refers to, directly or through
+// local functions
+static set<const GlobalVariable *> local_variables(const Function &f) {
+  set<const GlobalVariable *> vars;
+  set<const Value *> seen { &f };
+  vector<const User *> work { &f };
+  while (!work.empty()) {
+    auto user = work.back();
+    work.pop_back();
+    vector<const User *> users;
+    if (auto g = dyn_cast<Function>(user)) {
+      for (auto &inst : instructions(g)) {
+        users.push_back(&inst);
+      }
+    } else if (auto var = dyn_cast<GlobalVariable>(user)) {
+      if (!var->isConstant()) {
+        vars.insert(var);
+      }
+      if (var->hasInitializer()) {
+        users.push_back(var->getInitializer());
+      }
+    } else {
+      users.push_back(user);
+    }
+    for (auto u : users) {
+      for (auto &op : u->operands()) {
+        auto c = dyn_cast<Constant>(op);
+        if (!c || isa<ConstantData>(c) || !seen.insert(c).second) {
+          continue;
+        }
+        auto gv = dyn_cast<GlobalValue>(c);
+        if (!gv || gv->hasLocalLinkage()) {
+          work.push_back(c);
+        }
+      }
+    }
+  }
+  return vars;
+}
+
+// erase the local functions and variables which are not used any more
+static void erase_unused_locals(Module &mod) {
+  bool erased = true;
+  while (erased) {
+    erased = false;
+    for (auto it = mod.global_values().begin();
+         it != mod.global_values().end();) {
+      auto &gv = *it++;
+      if (gv.hasLocalLinkage() && gv.use_empty()) {
+        gv.eraseFromParent();
+        erased = true;
+      }
+    }
+  }
+}
+
+// hand over a module to the execution engine
+//
+// the exported functions get stubs, so they can be replaced; the
+// functions which already have stubs are redirected to the new
+// definitions, while committed global variables keep their state
+void CompileContext::add_to_engine(std::unique_ptr<Module> mod) {
+  mod->setDataLayout(ee_->getDataLayout());
+  for (auto &gv : mod->globals()) {
+    if (is_exported(gv) && find_committed_global(gv.getName().str())) {
+      gv.setInitializer(nullptr);
+      gv.setLinkage(GlobalValue::ExternalLinkage);
+      gv.setComdat(nullptr);
+    }
+  }
+  vector<Function *> fresh;
+  vector<Function *> redefined;
+  vector<Function *> unchanged;
+  // the mutable local variables of the functions compiled from mod,
+  // which get new copies of them
+  set<const GlobalVariable *> compiled_vars;
+  ModuleSlotTracker slots(mod.get());
+  map<const Module *, std::unique_ptr<ModuleSlotTracker>> committed_slots;
+  for (auto &f : mod->functions()) {
+    if (!is_exported(f)) {
+      continue;
+    }
+    if (!stubs_.count(f.getName().str())) {
+      if (!f.isVarArg()) {
+        fresh.push_back(&f);
+      }
+      auto vars = local_variables(f);
+      compiled_vars.insert(vars.begin(), vars.end());
+      continue;
+    }
+    // definitions which did not change are not compiled again
+    auto old = find_committed(f.getName().str());
+    if (!old) {
+      // removed by PATCH, and now defined again
+      redefined.push_back(&f);
+      auto vars = local_variables(f);
+      compiled_vars.insert(vars.begin(), vars.end());
+      continue;
+    }
+    auto &old_slots = committed_slots[old->getParent()];
+    if (!old_slots) {
+      old_slots = std::make_unique<ModuleSlotTracker>(old->getParent());
+    }
+    if (digest(f, slots) == digest(*old, *old_slots)) {
+      unchanged.push_back(&f);
+    } else {
+      redefined.push_back(&f);
+      auto vars = local_variables(f);
+      compiled_vars.insert(vars.begin(), vars.end());
+    }
+  }
+  // an unchanged definition sharing a local variable with a compiled
+  // one is compiled too, so they keep sharing it
+  bool shared = true;
+  while (shared) {
+    shared = false;
+    for (auto it = unchanged.begin(); it != unchanged.end();) {
+      auto vars = local_variables(**it);
+      bool shares = std::any_of(vars.begin(), vars.end(),
+                                [&](const GlobalVariable *var) {
+                                  return compiled_vars.count(var) > 0;
+                                });
+      if (shares) {
+        compiled_vars.insert(vars.begin(), vars.end());
+        redefined.push_back(*it);
+        it = unchanged.erase(it);
+        shared = true;
+      } else {
+        ++it;
+      }
+    }
+  }
+  for (auto f : unchanged) {
+    f->deleteBody();
+  }
+  erase_unused_locals(*mod);
+  // a module which only replaces definitions is released when they
+  // are all replaced again
+  bool transient = !redefined.empty() && fresh.empty();
+  for (auto &gv : mod->globals()) {
+    transient = transient && !is_exported(gv);
+  }
+  for (auto &f : mod->functions()) {
+    transient = transient && !(is_exported(f) && f.isVarArg());
+  }
+  Module *m = mod.get();
+  // the committed IR shall contain the latest definitions only
+  set<string> replaced;
+  for (auto f : redefined) {
+    string name = f->getName().str();
+    if (auto old = find_committed(name)) {
+      old->deleteBody();
+    }
+    removed_.erase(name);
+    replaced.insert(name);
+  }
+  if (!replaced.empty()) {
+    // pure callers of the replaced functions may have cached results
+    cache_.clear();
+  }
+  committed_.push_back(CloneModule(*mod));
+  for (auto f : fresh) {
+    make_stub(*f);
+  }
+  vector<pair<string, string>> redirects;
+  vector<Module *> superseded;
+  for (auto f : redefined) {
+    string name = f->getName().str();
+    auto &stub = stubs_[name];
+    stub.generation++;
+    if (stub.mod) {
+      superseded.push_back(stub.mod);
+    }
+    stub.mod = transient ? m : nullptr;
+    auto decl = Function::Create(f->getFunctionType(),
+                                 GlobalValue::ExternalLinkage, "",
+                                 mod.get());
+    decl->takeName(f);
+    f->replaceAllUsesWith(decl);
+    f->setName(name + ".impl." + to_string(stub.generation));
+    redirects.push_back({ stub.slot, f->getName().str() });
+  }
+  ee_->addModule(std::move(mod));
+  for (auto &r : redirects) {
+    auto slot = ee_->getGlobalValueAddress(r.first);
+    auto addr = ee_->getFunctionAddress(r.second);
+    reinterpret_cast<std::atomic<uint64_t> *>(slot)->store(addr);
+    if (transient) {
+      generations_[m] = Generation { (unsigned) redirects.size(), addr };
+    }
+  }
+  for (auto old : superseded) {
+    if (--generations_[old].live == 0) {
+      retire(old);
+    }
+  }
+  epochs_->collect();
+  if (replaced.empty()) {
+    return;
+  }
+  // generated code has the old definitions inlined
+  auto inlines_replaced = [&](const string &name) {
+    auto &inlined = fused_[name];
+    return std::any_of(inlined.begin(), inlined.end(),
+                       [&](const string &f) { return replaced.count(f) > 0; });
+  };
+  for (auto it = kernels_.begin(); it != kernels_.end();) {
+    auto next = std::next(it);
+    if (!composites_.count(it->first) && inlines_replaced(it->first)) {
+      kernels_.erase(it);
+    }
+    it = next;
+  }
+  for (auto &c : composites_) {
+    if (inlines_replaced(c.first)) {
+      commit_kernel(composite(c.first, c.second), c.first);
+    }
+  }
+}
+
+// release a replacement module and its code after the calls which
+// may still run the code have finished
+void CompileContext::retire(Module *mod) {
+  auto addr = generations_[mod].addr;
+  generations_.erase(mod);
+  epochs_->retire([this, mod, addr] {
+    ee_->removeModule(mod);
+    delete mod;
+    code_->release(addr);
+  });
+}
+
+Function *CompileContext::find_committed(const string &funcname) {
+  for (auto &mod : committed_) {
+    auto f = mod->getFunction(funcname);
+    if (f && is_exported(*f)) {
+      return f;
+    }
+  }
+  return nullptr;
+}
+
+GlobalValue *CompileContext::find_committed_global(const string &name) {
+  for (auto &mod : committed_) {
+    auto gv = mod->getNamedValue(name);
+    if (gv && is_exported(*gv)) {
+      return gv;
+    }
+  }
+  return nullptr;
+}
+
+// the definitions which code calling the given functions may inline:
+// the functions they call in their module (directly or not) and the
+// local variables used
+static set<const GlobalValue *>
+reachable_definitions(const vector<const Function *> &roots) {
+  set<const GlobalValue *> defs(roots.begin(), roots.end());
+  set<const Value *> seen(roots.begin(), roots.end());
+  vector<const User *> work(roots.begin(), roots.end());
+  while (!work.empty()) {
+    auto user = work.back();
+    work.pop_back();
+    vector<const User *> users;
+    if (auto f = dyn_cast<Function>(user)) {
+      for (auto &inst : instructions(f)) {
+        users.push_back(&inst);
+      }
+    } else if (auto var = dyn_cast<GlobalVariable>(user)) {
+      users.push_back(var->getInitializer());
+    } else {
+      users.push_back(user);
+    }
+    for (auto u : users) {
+      for (auto &op : u->operands()) {
+        auto c = dyn_cast<Constant>(op);
+        if (!c || isa<ConstantData>(c) || !seen.insert(c).second) {
+          continue;
+        }
+        auto gv = dyn_cast<GlobalValue>(c);
+        if (!gv) {
+          work.push_back(c);
+        } else if (isa<Function>(gv) ? !gv->isDeclaration()
+                                     : isa<GlobalVariable>(gv) &&
+                                       gv->hasLocalLinkage()) {
+          defs.insert(gv);
+          work.push_back(gv);
+        }
+      }
+    }
+  }
+  return defs;
+}
+
+// create a module in which generated code can call (and inline) the
+// given committed functions
+//
+// the definitions which the functions reach in the modules defining
+// them are cloned and linked together (so the rest of the modules is
+// not optimized again), then their functions are turned into
+// available_externally definitions and their global variables into
+// declarations, so the generated code shares the state of the
+// committed code and the cloned bodies vanish after optimization
+//
+// local variables cannot be shared that way, so functions using local
+// mutable variables are refused rather than given copies of them
+std::unique_ptr<Module>
+CompileContext::fusion_module(const string &name,
+                              const vector<string> &funcnames) {
+  auto fused = std::make_unique<Module>(name, ctx_);
+  fused->setDataLayout(ee_->getDataLayout());
+  fused->setTargetTriple(ee_->getTargetMachine()->getTargetTriple().str());
+  // the functions to fuse by the module defining them
+  map<const Module *, vector<const Function *>> sources;
+  for (auto &funcname : funcnames) {
+    auto f = find_committed(funcname);
+    if (!f) {
+      throw std::invalid_argument("unknown function: " + funcname);
+    }
+    sources[f->getParent()].push_back(f);
+  }
+  for (auto &src : sources) {
+    auto defs = reachable_definitions(src.second);
+    ValueToValueMapTy vmap;
+    auto clone = CloneModule(*src.first, vmap, [&](const GlobalValue *gv) {
+      return defs.count(gv) > 0;
+    });
+    // the definitions which are not cloned leave declarations behind
+    for (auto it = clone->global_values().begin();
+         it != clone->global_values().end();) {
+      auto &gv = *it++;
+      if (gv.isDeclaration() && gv.use_empty()) {
+        gv.eraseFromParent();
+      }
+    }
+    clone->setDataLayout(fused->getDataLayout());
+    clone->setTargetTriple(fused->getTargetTriple());
+    if (Linker::linkModules(*fused, std::move(clone))) {
+      throw std::runtime_error("link failure");
+    }
+  }
+  for (auto &gv : fused->globals()) {
+    if (!gv.isDeclaration() && !gv.hasLocalLinkage()) {
+      gv.setInitializer(nullptr);
+      gv.setLinkage(GlobalValue::ExternalLinkage);
+      gv.setComdat(nullptr);
+    }
+  }
+  for (auto &f : fused->functions()) {
+    if (!f.isDeclaration() && !f.hasLocalLinkage()) {
+      f.setLinkage(GlobalValue::AvailableExternallyLinkage);
+      f.setComdat(nullptr);
+    }
+  }
+  for (auto &funcname : funcnames) {
+    if (auto var = local_state(*fused->getFunction(funcname))) {
+      throw std::invalid_argument("cannot fuse " + funcname +
+                                  ": it uses the local variable " +
+                                  var->getName().str());
+    }
+  }
+  auto &inlined = fused_[name];
+  inlined.clear();
+  for (auto &f : fused->functions()) {
+    if (f.hasAvailableExternallyLinkage()) {
+      inlined.insert(f.getName().str());
+    }
+  }
+  return fused;
+}
+
+uint64_t CompileContext::commit_kernel(std::unique_ptr<Module> mod,
+                                       const string &name) {
+  if (verifyModule(*mod, &errs())) {
+    throw std::invalid_argument("generated invalid code for " + name);
+  }
+  optimize(*mod);
+  check_redefinitions(*mod, true);
+  add_to_engine(std::move(mod));
+  auto addr = lookup(name);
+  kernels_[name] = addr;
+  return addr;
+}
+
+uint64_t CompileContext::lookup(const string &funcname) {
+  if (removed_.count(funcname)) {
+    throw std::invalid_argument("unknown function");
+  }
+  auto addr = ee_->getFunctionAddress(funcname);
+  if (!addr) {
+    throw std::invalid_argument("unknown function");
+  }
+  return addr;
+}
+
+bool CompileContext::is_pure(const string &funcname) {
+  if (pure_.count(funcname)) {
+    return true;
+  }
+  // the function attributes inferred by OPT also tell
+  auto f = find_committed(funcname);
+  return f && (f->onlyReadsMemory() || f->onlyAccessesArgMemory());
+}
+
+void CompileContext::pure(const string &funcname) {
+  if (!find_committed(funcname)) {
+    throw std::invalid_argument("unknown function");
+  }
+  pure_.insert(funcname);
+}
+
+bool CompileContext::is_coroutine(const string &funcname) {
+  auto f = find_committed(funcname);
+  return f && f->hasFnAttribute(coroutine_attr);
 }
 
 ByteArray CompileContext::call(const string &funcname,
-                               size_t bufsize) {
+                               size_t bufsize,
+                               const ByteArray &input,
+                               const string &handle,
+                               bool interpret) {
   typedef void (*Callable)(void*);
-  auto f = (Callable) ee_->getFunctionAddress(funcname);
-  if (!f) {
-    throw std::invalid_argument("unknown function");
+  typedef CoroutineFrame *(*CoroutineStart)(void*);
+  if (input.size() > bufsize) {
+    throw std::invalid_argument("input does not fit into the buffer");
+  }
+  Epochs::Guard guard(*epochs_);
+  if (is_coroutine(funcname)) {
+    if (!handle.empty()) {
+      check_name(handle);
+    }
+    auto start = (CoroutineStart) lookup(funcname);
+    // the coroutine keeps writing to the buffer when resumed, so the
+    // buffer must not move
+    Coroutine co { nullptr, std::make_unique<ByteArray>(bufsize),
+                   epochs_->enter() };
+    std::copy(input.begin(), input.end(), co.buf->begin());
+    co.frame = start(co.buf->begin());
+    return suspended(handle, std::move(co));
+  }
+  if (!handle.empty()) {
+    throw std::invalid_argument("not a coroutine: " + funcname);
+  }
+  string key;
+  if (is_pure(funcname)) {
+    key = funcname + '\0' + to_string(bufsize) + '\0';
+    key.append(input.begin(), input.end());
+    if (auto result = cache_.get(key)) {
+      return *result;
+    }
   }
+  // cold functions are interpreted on their first call
+  auto def = find_committed(funcname);
+  if (def && def->hasFnAttribute(Attribute::Cold) && !called_.count(funcname)) {
+    interpret = true;
+  }
+  called_.insert(funcname);
   ByteArray response(bufsize);
-  f(response.begin());
+  std::copy(input.begin(), input.end(), response.begin());
+  if (interpret && def && interpretable(*def->getParent())) {
+    run_interpreted(*def, response.begin());
+  } else {
+    auto f = (Callable) lookup(funcname);
+    f(response.begin());
+  }
+  if (!key.empty()) {
+    cache_.put(key, response);
+  }
   return std::move(response);
 }
 
+// the interpreter works on its own copy of the module, so only a
+// module without mutable state of its own which does not depend on
+// other committed modules can be interpreted
+// the intrinsics which the interpreter can run (it aborts on the others)
+static bool interpreted_intrinsic(Intrinsic::ID id) {
+  switch (id) {
+  case Intrinsic::vastart:
+  case Intrinsic::vaend:
+  case Intrinsic::vacopy:
+  case Intrinsic::expect:
+  case Intrinsic::ctpop:
+  case Intrinsic::bswap:
+  case Intrinsic::ctlz:
+  case Intrinsic::cttz:
+  case Intrinsic::memcpy:
+  case Intrinsic::memset:
+  case Intrinsic::assume:
+  case Intrinsic::dbg_declare:
+  case Intrinsic::dbg_value:
+  case Intrinsic::dbg_label:
+  case Intrinsic::lifetime_start:
+  case Intrinsic::lifetime_end:
+  case Intrinsic::invariant_start:
+  case Intrinsic::invariant_end:
+    return true;
+  default:
+    return false;
+  }
+}
+
+bool CompileContext::interpretable(const Module &mod) {
+  auto external = [this](const GlobalValue &gv) {
+    return !find_committed_global(gv.getName().str()) &&
+      sys::DynamicLibrary::SearchForAddressOfSymbol(gv.getName().str());
+  };
+  for (auto &gv : mod.globals()) {
+    if (gv.isDeclaration() ? !external(gv) : !gv.isConstant()) {
+      return false;
+    }
+  }
+  for (auto &f : mod.functions()) {
+    if (f.isIntrinsic() ? !interpreted_intrinsic(f.getIntrinsicID())
+                        : f.isDeclaration() && !external(f)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void CompileContext::run_interpreted(const Function &f, void *buf) {
+  auto mod = CloneModule(*f.getParent());
+  auto clone = mod->getFunction(f.getName());
+  EngineBuilder builder(std::move(mod));
+  string ErrorMsg;
+  builder.setErrorStr(&ErrorMsg);
+  builder.setEngineKind(EngineKind::Interpreter);
+  std::unique_ptr<ExecutionEngine> interpreter(builder.create());
+  if (!interpreter) {
+    throw std::runtime_error(ErrorMsg);
+  }
+  interpreter->runFunction(clone, { PTOGV(buf) });
+}
+
+void CompileContext::async_call(const string &funcname, size_t bufsize,
+                                const ByteArray &input,
+                                const string &handle) {
+  typedef void (*Callable)(void*);
+  check_name(handle);
+  if (input.size() > bufsize) {
+    throw std::invalid_argument("input does not fit into the buffer");
+  }
+  if (is_coroutine(funcname)) {
+    throw std::invalid_argument("cannot call a coroutine asynchronously");
+  }
+  // compile here, so the executor only runs code
+  auto f = (Callable) lookup(funcname);
+  auto epochs = epochs_.get();
+  auto task = std::make_shared<std::packaged_task<ByteArray()>>(
+    [f, bufsize, input, epochs] {
+      Epochs::Guard guard(*epochs);
+      ByteArray response(bufsize);
+      std::copy(input.begin(), input.end(), response.begin());
+      f(response.begin());
+      return response;
+    });
+  async_[handle] = task->get_future();
+  if (!executor_) {
+    executor_ = std::make_unique<Executor>();
+  }
+  executor_->submit([task] { (*task)(); });
+}
+
+ByteArray CompileContext::await(const string &handle) {
+  auto it = async_.find(handle);
+  if (it == async_.end()) {
+    throw std::invalid_argument("unknown asynchronous call: " + handle);
+  }
+  auto result = std::move(it->second);
+  async_.erase(it);
+  auto response = result.get();
+  epochs_->collect();
+  return std::move(response);
+}
+
+// return the chunk yielded by a coroutine and keep the coroutine
+// under the handle (if any) until it finishes
+ByteArray CompileContext::suspended(const string &handle, Coroutine co) {
+  if (!co.frame->resume) {
+    destroy(co);
+    return ByteArray();
+  }
+  ByteArray chunk = *co.buf;
+  if (handle.empty()) {
+    destroy(co);
+  } else {
+    coroutines_[handle] = std::move(co);
+  }
+  return std::move(chunk);
+}
+
+ByteArray CompileContext::resume(const string &handle) {
+  auto it = coroutines_.find(handle);
+  if (it == coroutines_.end()) {
+    throw std::invalid_argument("unknown coroutine: " + handle);
+  }
+  auto co = std::move(it->second);
+  coroutines_.erase(it);
+  co.frame->resume(co.frame);
+  return suspended(handle, std::move(co));
+}
+
+static const size_t max_buffer_args = 8;
+
+// invoke a function taking pointers to buffers
+static void invoke(uint64_t addr, const vector<void*> &args) {
+  typedef void *P;
+  switch (args.size()) {
+  case 1:
+    ((void (*)(P)) addr)(args[0]);
+    break;
+  case 2:
+    ((void (*)(P, P)) addr)(args[0], args[1]);
+    break;
+  case 3:
+    ((void (*)(P, P, P)) addr)(args[0], args[1], args[2]);
+    break;
+  case 4:
+    ((void (*)(P, P, P, P)) addr)(args[0], args[1], args[2], args[3]);
+    break;
+  case 5:
+    ((void (*)(P, P, P, P, P)) addr)
+      (args[0], args[1], args[2], args[3], args[4]);
+    break;
+  case 6:
+    ((void (*)(P, P, P, P, P, P)) addr)
+      (args[0], args[1], args[2], args[3], args[4], args[5]);
+    break;
+  case 7:
+    ((void (*)(P, P, P, P, P, P, P)) addr)
+      (args[0], args[1], args[2], args[3], args[4], args[5], args[6]);
+    break;
+  case 8:
+    ((void (*)(P, P, P, P, P, P, P, P)) addr)
+      (args[0], args[1], args[2], args[3], args[4], args[5], args[6], args[7]);
+    break;
+  default:
+    throw std::invalid_argument("a function takes 1-8 buffer arguments");
+  }
+}
+
+struct StreamState {
+  const Sink &sink;
+  size_t chunk_size;
+  ByteArray chunk;
+  exception_ptr error;
+};
+
+// the emit callback passed to streaming functions
+//
+// exceptions must not unwind through JIT-ed frames, so errors of the
+// sink are kept until the function returns
+static void stream_emit(void *ctx, const char *data, size_t len) {
+  auto &st = *static_cast<StreamState *>(ctx);
+  if (st.error) {
+    return;
+  }
+  try {
+    while (len > 0) {
+      if (st.chunk.empty() && len >= st.chunk_size) {
+        // no need to copy a full chunk
+        st.sink(data, st.chunk_size);
+        data += st.chunk_size;
+        len -= st.chunk_size;
+        continue;
+      }
+      size_t n = std::min(len, st.chunk_size - st.chunk.size());
+      st.chunk.append(data, data + n);
+      data += n;
+      len -= n;
+      if (st.chunk.size() == st.chunk_size) {
+        st.sink(st.chunk.begin(), st.chunk.size());
+        st.chunk.clear();
+      }
+    }
+  }
+  catch (...) {
+    st.error = current_exception();
+  }
+}
+
+void CompileContext::stream(const string &funcname, size_t chunk_size,
+                            const Sink &sink) {
+  typedef void (*Emit)(void *ctx, const char *data, size_t len);
+  typedef void (*Streamer)(void *ctx, Emit emit);
+  if (chunk_size == 0) {
+    throw std::invalid_argument("chunk size must be positive");
+  }
+  Epochs::Guard guard(*epochs_);
+  auto f = (Streamer) lookup(funcname);
+  StreamState st { sink, chunk_size, ByteArray(), nullptr };
+  st.chunk.reserve(chunk_size);
+  f(&st, stream_emit);
+  if (st.error) {
+    rethrow_exception(st.error);
+  }
+  if (!st.chunk.empty()) {
+    sink(st.chunk.begin(), st.chunk.size());
+  }
+}
+
+ByteArray CompileContext::feed(const string &funcname, size_t bufsize,
+                               const Source &source) {
+  typedef void (*Consumer)(void *buf, const char *data, size_t len);
+  Epochs::Guard guard(*epochs_);
+  auto f = (Consumer) lookup(funcname);
+  ByteArray response(bufsize);
+  // the function consumes one chunk on the pool while the next one is
+  // received into the other
+  ByteArray chunks[2];
+  int current = 0;
+  bool more = source(chunks[current]);
+  while (more) {
+    auto &chunk = chunks[current];
+    pool().submit([&] { f(response.begin(), chunk.begin(), chunk.size()); });
+    try {
+      more = source(chunks[1 - current]);
+    }
+    catch (...) {
+      pool().wait();
+      throw;
+    }
+    pool().wait();
+    current = 1 - current;
+  }
+  return std::move(response);
+}
+
+void CompileContext::call(const string &funcname,
+                          const vector<string> &bufnames) {
+  vector<void*> args;
+  for (auto &name : bufnames) {
+    args.push_back(buffer(name).data());
+  }
+  Epochs::Guard guard(*epochs_);
+  invoke(lookup(funcname), args);
+}
+
+ByteArray CompileContext::graph(const ByteArray &spec,
+                                const vector<string> &outputs) {
+  struct Node {
+    uint64_t addr;
+    vector<void*> args;
+    vector<size_t> successors;
+    size_t ndeps;
+  };
+  vector<Node> nodes;
+  // the last node writing a buffer and the nodes reading it since then
+  std::map<string, size_t> writer;
+  std::map<string, vector<size_t>> readers;
+  std::istringstream lines(string(spec.begin(), spec.end()));
+  string line;
+  while (getline(lines, line)) {
+    std::istringstream is(line);
+    string funcname, word;
+    if (!(is >> funcname)) {
+      continue;
+    }
+    size_t index = nodes.size();
+    Node node { lookup(funcname), {}, {}, 0 };
+    std::set<size_t> deps;
+    bool writes = false;
+    while (is >> word) {
+      if (word == "->") {
+        writes = true;
+        continue;
+      }
+      node.args.push_back(buffer(word).data());
+      auto w = writer.find(word);
+      if (w != writer.end()) {
+        deps.insert(w->second);
+      }
+      if (writes) {
+        // wait for the readers of the previous contents
+        for (auto r : readers[word]) {
+          deps.insert(r);
+        }
+        readers[word].clear();
+        writer[word] = index;
+      } else {
+        readers[word].push_back(index);
+      }
+    }
+    if (node.args.empty() || node.args.size() > max_buffer_args) {
+      throw std::invalid_argument("a function takes 1-8 buffer arguments");
+    }
+    deps.erase(index);
+    for (auto dep : deps) {
+      nodes[dep].successors.push_back(index);
+    }
+    node.ndeps = deps.size();
+    nodes.push_back(std::move(node));
+  }
+  vector<Buffer *> results;
+  for (auto &name : outputs) {
+    results.push_back(&buffer(name));
+  }
+  // run each node as soon as all of its dependencies have finished
+  vector<std::atomic<size_t>> remaining(nodes.size());
+  for (size_t i = 0; i < nodes.size(); i++) {
+    remaining[i] = nodes[i].ndeps;
+  }
+  Epochs::Guard guard(*epochs_);
+  auto &p = pool();
+  std::function<void(size_t)> run = [&](size_t i) {
+    invoke(nodes[i].addr, nodes[i].args);
+    for (auto s : nodes[i].successors) {
+      if (--remaining[s] == 0) {
+        p.submit([&run, s] { run(s); });
+      }
+    }
+  };
+  for (size_t i = 0; i < nodes.size(); i++) {
+    if (nodes[i].ndeps == 0) {
+      p.submit([&run, i] { run(i); });
+    }
+  }
+  p.wait();
+  ByteArray response;
+  for (auto buf : results) {
+    response.append(buf->data(), buf->data() + buf->size());
+  }
+  return std::move(response);
+}
+
+ByteArray CompileContext::map_call(const string &funcname, size_t count,
+                                   size_t in_stride, size_t out_stride,
+                                   const ByteArray &input) {
+  typedef void (*Kernel)(const void *in, void *out, size_t count);
+  size_t limit = std::numeric_limits<size_t>::max();
+  if (count > 0 && (in_stride > limit / count || out_stride > limit / count)) {
+    throw std::invalid_argument("count * stride overflows");
+  }
+  if (input.size() != count * in_stride) {
+    throw std::invalid_argument("input size does not match count * in_stride");
+  }
+  string name = "__map." + funcname + "." + to_string(in_stride) +
+    "." + to_string(out_stride);
+  auto it = kernels_.find(name);
+  Kernel kernel;
+  if (it != kernels_.end()) {
+    kernel = (Kernel) it->second;
+  } else {
+    auto mod = fusion_module(name, {funcname});
+    auto f = mod->getFunction(funcname);
+    auto fty = f->getFunctionType();
+    if (!fty->getReturnType()->isVoidTy() || fty->getNumParams() != 2 ||
+        !fty->getParamType(0)->isPointerTy() ||
+        !fty->getParamType(1)->isPointerTy()) {
+      throw std::invalid_argument("MAP needs a function of type void (i8*, i8*)");
+    }
+    // void kernel(i8* noalias in, i8* noalias out, i64 count) {
+    //   for (i = 0; i < count; i++)
+    //     f(in + i * in_stride, out + i * out_stride);
+    // }
+    auto i8ptr = Type::getInt8PtrTy(ctx_);
+    auto i64 = Type::getInt64Ty(ctx_);
+    auto kty = FunctionType::get(Type::getVoidTy(ctx_),
+                                 {i8ptr, i8ptr, i64}, false);
+    auto k = Function::Create(kty, GlobalValue::ExternalLinkage,
+                              name, mod.get());
+    k->addParamAttr(0, Attribute::NoAlias);
+    k->addParamAttr(1, Attribute::NoAlias);
+    auto in = k->getArg(0);
+    auto out = k->getArg(1);
+    auto n = k->getArg(2);
+    auto entry = BasicBlock::Create(ctx_, "entry", k);
+    auto loop = BasicBlock::Create(ctx_, "loop", k);
+    auto exit = BasicBlock::Create(ctx_, "exit", k);
+    IRBuilder<> b(entry);
+    b.CreateCondBr(b.CreateICmpEQ(n, b.getInt64(0)), exit, loop);
+    b.SetInsertPoint(loop);
+    auto i = b.CreatePHI(i64, 2, "i");
+    i->addIncoming(b.getInt64(0), entry);
+    auto pin = b.CreateGEP(b.getInt8Ty(), in,
+                           b.CreateMul(i, b.getInt64(in_stride)));
+    auto pout = b.CreateGEP(b.getInt8Ty(), out,
+                            b.CreateMul(i, b.getInt64(out_stride)));
+    auto call = b.CreateCall(f, {
+        b.CreateBitCast(pin, fty->getParamType(0)),
+        b.CreateBitCast(pout, fty->getParamType(1))});
+    call->addFnAttr(Attribute::AlwaysInline);
+    auto next = b.CreateAdd(i, b.getInt64(1));
+    i->addIncoming(next, loop);
+    b.CreateCondBr(b.CreateICmpEQ(next, n), exit, loop);
+    b.SetInsertPoint(exit);
+    b.CreateRetVoid();
+    kernel = (Kernel) commit_kernel(std::move(mod), name);
+  }
+  ByteArray response(count * out_stride);
+  Epochs::Guard guard(*epochs_);
+  kernel(input.begin(), response.begin(), count);
+  return std::move(response);
+}
+
+void CompileContext::compose(const string &name,
+                             const vector<string> &funcnames) {
+  if (funcnames.empty()) {
+    throw std::invalid_argument("nothing to compose");
+  }
+  if (find_committed(name)) {
+    throw std::invalid_argument("function already exists: " + name);
+  }
+  commit_kernel(composite(name, funcnames), name);
+  composites_[name] = funcnames;
+}
+
+std::unique_ptr<Module>
+CompileContext::composite(const string &name,
+                          const vector<string> &funcnames) {
+  auto mod = fusion_module(name, funcnames);
+  // the composite takes the arguments of the first function and
+  // returns the result of the last one
+  //
+  // a function which returns a value passes it to the next one as its
+  // only argument, a function returning void lets the next one work on
+  // the original arguments
+  auto first = mod->getFunction(funcnames.front());
+  auto last = mod->getFunction(funcnames.back());
+  auto cty = FunctionType::get(last->getReturnType(),
+                               first->getFunctionType()->params(), false);
+  auto c = Function::Create(cty, GlobalValue::ExternalLinkage,
+                            name, mod.get());
+  vector<Value *> args;
+  for (auto &arg : c->args()) {
+    args.push_back(&arg);
+  }
+  IRBuilder<> b(BasicBlock::Create(ctx_, "entry", c));
+  Value *result = nullptr;
+  for (auto &funcname : funcnames) {
+    auto f = mod->getFunction(funcname);
+    vector<Value *> fargs = args;
+    if (result) {
+      fargs = {result};
+    }
+    auto fty = f->getFunctionType();
+    bool match = fty->getNumParams() == fargs.size();
+    for (size_t i = 0; match && i < fargs.size(); i++) {
+      match = fty->getParamType(i) == fargs[i]->getType();
+    }
+    if (!match) {
+      throw std::invalid_argument("cannot pass arguments to " + funcname);
+    }
+    auto call = b.CreateCall(f, fargs);
+    call->addFnAttr(Attribute::AlwaysInline);
+    result = fty->getReturnType()->isVoidTy() ? nullptr : call;
+  }
+  if (result) {
+    b.CreateRet(result);
+  } else {
+    b.CreateRetVoid();
+  }
+  return mod;
+}
+
+ThreadPool &CompileContext::pool() {
+  if (!pool_) {
+    pool_ = std::make_unique<ThreadPool>();
+  }
+  return *pool_;
+}
+
+ByteArray CompileContext::pcall(const string &funcname,
+                                const string &bufname,
+                                size_t chunk_size, size_t result_size,
+                                const string &reduce_funcname) {
+  typedef void (*ChunkFn)(const void *chunk, size_t len, void *result);
+  typedef void (*ReduceFn)(void *acc, const void *partial);
+  if (chunk_size == 0 || result_size == 0) {
+    throw std::invalid_argument("chunk and result size must be positive");
+  }
+  auto &buf = buffer(bufname);
+  Epochs::Guard guard(*epochs_);
+  auto f = (ChunkFn) lookup(funcname);
+  ReduceFn reduce = nullptr;
+  if (!reduce_funcname.empty()) {
+    reduce = (ReduceFn) lookup(reduce_funcname);
+  }
+  size_t nchunks = (buf.size() + chunk_size - 1) / chunk_size;
+  if (nchunks > 0 &&
+      result_size > std::numeric_limits<size_t>::max() / nchunks) {
+    throw std::invalid_argument("chunk count * result size overflows");
+  }
+  ByteArray results(nchunks * result_size);
+  pool().parallel_for(nchunks, [&](size_t i) {
+    size_t offset = i * chunk_size;
+    size_t len = std::min(chunk_size, buf.size() - offset);
+    f(buf.data() + offset, len, results.begin() + i * result_size);
+  });
+  if (!reduce) {
+    return std::move(results);
+  }
+  // combine neighbouring results pairwise, so the reduce function
+  // only needs to be associative
+  for (size_t stride = 1; stride < nchunks; stride *= 2) {
+    size_t npairs = (nchunks - stride + 2 * stride - 1) / (2 * stride);
+    pool().parallel_for(npairs, [&](size_t i) {
+      size_t left = i * 2 * stride;
+      reduce(results.begin() + left * result_size,
+             results.begin() + (left + stride) * result_size);
+    });
+  }
+  results.resize(result_size);
+  return std::move(results);
+}
+
+Buffer &CompileContext::buffer(const string &name) {
+  auto it = buffers_.find(name);
+  if (it == buffers_.end()) {
+    throw std::invalid_argument("unknown buffer: " + name);
+  }
+  return *it->second;
+}
+
+// buffers, coroutines and asynchronous calls share a namespace
+void CompileContext::check_name(const string &name) {
+  if (name.empty() || isdigit(name[0])) {
+    // numbers are reserved for sizes in CALL
+    throw std::invalid_argument("names must not start with a digit");
+  }
+  if (buffers_.count(name) || coroutines_.count(name) || async_.count(name)) {
+    throw std::invalid_argument("name already in use: " + name);
+  }
+}
+
+void CompileContext::alloc(const string &name, size_t size) {
+  check_name(name);
+  if (size == 0) {
+    throw std::invalid_argument("buffer size must be positive");
+  }
+  buffers_[name] = std::make_unique<Buffer>(size);
+}
+
+void CompileContext::free(const string &name) {
+  if (buffers_.erase(name)) {
+    return;
+  }
+  auto it = coroutines_.find(name);
+  if (it == coroutines_.end()) {
+    throw std::invalid_argument("unknown buffer or coroutine: " + name);
+  }
+  destroy(it->second);
+  coroutines_.erase(it);
+  epochs_->collect();
+}
+
+ByteArray CompileContext::read(const string &name,
+                               size_t offset, size_t size) {
+  auto &buf = buffer(name);
+  if (offset > buf.size() || size > buf.size() - offset) {
+    throw std::out_of_range("read beyond the end of buffer");
+  }
+  return ByteArray(buf.data() + offset, buf.data() + offset + size);
+}
+
+void CompileContext::write(const string &name,
+                           size_t offset, const ByteArray &data) {
+  auto &buf = buffer(name);
+  if (offset > buf.size() || data.size() > buf.size() - offset) {
+    throw std::out_of_range("write beyond the end of buffer");
+  }
+  std::copy(data.begin(), data.end(), buf.data() + offset);
+}
+
 void CompileContext::import(const string &path) {
   auto err = sys::DynamicLibrary::LoadLibraryPermanently(path.c_str());
   if (err) {
@@ -1,16 +1,32 @@
+#include <functional>
+#include <future>
 #include <iostream>
+#include <list>
+#include <map>
+#include <set>
 
+#include <llvm/ADT/DenseMap.h>
 #include <llvm/ADT/SmallVector.h>
+#include <llvm/ADT/StringRef.h>
 #include <llvm/Support/TargetSelect.h>
+#include <llvm/Support/Memory.h>
+#include <llvm/Support/MemoryBuffer.h>
 #include <llvm/IR/LLVMContext.h>
 #include <llvm/IR/Module.h>
 #include <llvm/ExecutionEngine/ExecutionEngine.h>
+#include <llvm/Passes/OptimizationLevel.h>
 
 using namespace std;
 using namespace llvm;
 
 using ByteArray = SmallVector<char, 4096>;
 
+// receives the chunks of a streamed result
+using Sink = std::function<void(const char *data, size_t len)>;
+
+// produces the chunks of a streamed input, returns false at the end
+using Source = std::function<bool(ByteArray &chunk)>;
+
 struct LLVMInitializer {
   LLVMInitializer() {
     InitializeNativeTarget();
@@ -20,20 +36,235 @@ struct LLVMInitializer {
   }
 };
 
+// a named server-side buffer which survives between calls
+//
+// the memory is mapped directly from the OS, so it is page-aligned
+// and zero-initialized
+class Buffer {
+  sys::MemoryBlock block_;
+  size_t size_;
+
+public:
+  Buffer(size_t size);
+  ~Buffer();
+  Buffer(const Buffer &) = delete;
+  Buffer &operator=(const Buffer &) = delete;
+
+  char *data() { return static_cast<char*>(block_.base()); }
+  size_t size() const { return size_; }
+};
+
+// a bounded LRU cache for the results of pure function calls
+class CallCache {
+  struct Entry {
+    string key;
+    ByteArray result;
+  };
+  // most recently used entries first
+  list<Entry> entries_;
+  DenseMap<StringRef, list<Entry>::iterator> index_;
+  size_t size_;
+  size_t limit_;
+
+  void erase(list<Entry>::iterator it);
+
+public:
+  CallCache(size_t limit) : size_(0), limit_(limit) {}
+
+  const ByteArray *get(const string &key);
+  void put(const string &key, const ByteArray &result);
+  void clear();
+};
+
+// the frame of a coroutine lowered with the switch ABI starts with
+// pointers to its resume and destroy functions
+//
+// the resume pointer is null when the coroutine is at its final
+// suspend point
+struct CoroutineFrame {
+  void (*resume)(CoroutineFrame *);
+  void (*destroy)(CoroutineFrame *);
+};
+
+struct Coroutine {
+  CoroutineFrame *frame;
+  std::unique_ptr<ByteArray> buf;
+  // the coroutine keeps the code it was started with alive
+  uint64_t epoch;
+};
+
+// a stub jumping to the current definition of a committed function
+struct Stub {
+  // global variable holding the address of the definition
+  string slot;
+  FunctionType *type;
+  // incremented by each replacement
+  unsigned generation;
+  // the replacement module with the current definition, if the module
+  // can be released once all of its definitions are replaced
+  Module *mod;
+};
+
+// a replacement module with the number of its current definitions
+struct Generation {
+  unsigned live;
+  // the address of a definition, which identifies the code memory
+  uint64_t addr;
+};
+
+class ThreadPool;
+class Executor;
+class Epochs;
+class CodeMemory;
+class Library;
+
 class CompileContext {
   LLVMInitializer init_;
   LLVMContext ctx_;
   std::unique_ptr<ExecutionEngine> ee_;
+  // owned by the execution engine
+  CodeMemory *code_;
   vector<std::unique_ptr<Module>> stack_;
+  // pristine copies of the committed modules
+  vector<std::unique_ptr<Module>> committed_;
+  // the latest versions of the modules committed by the client, by
+  // hash
+  map<string, std::unique_ptr<Module>> sources_;
+  // the hashes of the modules loaded by watch(), by path
+  map<string, string> watched_;
+  // the bitcode of the modules parsed by parse_hash(), by content hash,
+  // and the hashes in order of insertion
+  map<string, ByteArray> parsed_;
+  list<string> parsed_order_;
+  size_t parsed_size_;
+  string cache_dir_;
+  const Library *library_;
+  // the library files which have been committed
+  set<string> loaded_;
+  // generated kernels (e.g. MAP loops) by name
+  map<string, uint64_t> kernels_;
+  // composites built by COMPOSE from their parts
+  map<string, vector<string>> composites_;
+  // the committed functions which each kernel and composite may have
+  // inlined
+  map<string, set<string>> fused_;
+  map<string, Stub> stubs_;
+  // functions removed by PATCH, whose stubs remain
+  set<string> removed_;
+  map<Module *, Generation> generations_;
+  // calls enter an epoch, so replaced code is released only after the
+  // calls which may run it have finished
+  std::unique_ptr<Epochs> epochs_;
+  // functions marked pure by the client
+  set<string> pure_;
+  CallCache cache_;
+  // suspended coroutines by handle
+  map<string, Coroutine> coroutines_;
+  // functions called at least once
+  set<string> called_;
+  map<string, std::unique_ptr<Buffer>> buffers_;
+  std::unique_ptr<ThreadPool> pool_;
+  // runs asynchronous calls while the session goes on compiling
+  std::unique_ptr<Executor> executor_;
+  // results of asynchronous calls by handle
+  map<string, std::future<ByteArray>> async_;
+
+  uint64_t lookup(const string &funcname);
+  Buffer &buffer(const string &name);
+  ThreadPool &pool();
+  void parse_buffer(MemoryBufferRef buf);
+  string cache_path(const string &hash);
+  void store_parsed(const string &hash, StringRef bitcode);
+  void forget_parsed(const string &hash);
+  void optimize(Module &mod, OptimizationLevel level = OptimizationLevel::O2);
+  Function *find_committed(const string &funcname);
+  GlobalValue *find_committed_global(const string &name);
+  bool interpretable(const Module &mod);
+  void run_interpreted(const Function &f, void *buf);
+  bool is_pure(const string &funcname);
+  bool is_coroutine(const string &funcname);
+  ByteArray suspended(const string &handle, Coroutine co);
+  void check_name(const string &name);
+  std::unique_ptr<Module> fusion_module(const string &name,
+                                        const vector<string> &funcnames);
+  uint64_t commit_kernel(std::unique_ptr<Module> mod, const string &name);
+  std::unique_ptr<Module> composite(const string &name,
+                                    const vector<string> &funcnames);
+  void drop_weak_redefinitions(Module &mod);
+  void check_redefinitions(const Module &mod, bool replace);
+  void make_stub(Function &f);
+  void add_to_engine(std::unique_ptr<Module> mod);
+  string commit_module(bool replace);
+  string add_source(std::unique_ptr<Module> mod);
+  void load_library(const Module &mod);
+  void retire(Module *mod);
+  void destroy(Coroutine &co);
 
 public:
-  CompileContext();
+  // modules parsed by PARSEHASH are cached in cache_dir (if given) for
+  // other sessions
+  //
+  // committed modules may leave symbols for the modules in library
+  // (if given) to define
+  explicit CompileContext(const string &cache_dir = "",
+                          const Library *library = nullptr);
+  ~CompileContext();
 
   void parse(const ByteArray &input);
+  // the buffer is released after parsing
+  void parse(std::unique_ptr<MemoryBuffer> input);
+  // parse the module in a local file
+  void parse_file(const string &path);
+  // does the session or the cache have the module with the given
+  // content hash (the SHA-256 of the PARSEHASH payload)
+  bool have(const string &hash);
+  // push the module with the given content hash
+  void parse_hash(const string &hash);
+  // parse a module and keep it under its content hash
+  void parse_hash(const string &hash, std::unique_ptr<MemoryBuffer> input);
+  // parse the concatenated modules of the given sizes and push them in
+  // order
+  void parse_many(std::unique_ptr<MemoryBuffer> input,
+                  const vector<size_t> &sizes);
   void opt();
   ByteArray dump();
-  void link();
-  void commit();
-  ByteArray call(const string &funcname, size_t bufsize);
+  // send the bitcode to sink in chunks of chunk_size bytes
+  void dump(size_t chunk_size, const Sink &sink);
+  // write the bitcode to a local file
+  void dump_file(const string &path);
+  // with only_needed, link only the definitions of M1 that M2 uses
+  void link(bool only_needed = false);
+  // the commands committing a module return its hash
+  string commit();
+  string replace();
+  string patch(const string &hash, const vector<string> &removed);
+  // commit the module in the file at path, or replace it if it has
+  // been committed before
+  string watch(const string &path);
+  ByteArray call(const string &funcname, size_t bufsize,
+                 const ByteArray &input = ByteArray(),
+                 const string &handle = "",
+                 bool interpret = false);
+  ByteArray resume(const string &handle);
+  void async_call(const string &funcname, size_t bufsize,
+                  const ByteArray &input, const string &handle);
+  ByteArray await(const string &handle);
+  void stream(const string &funcname, size_t chunk_size, const Sink &sink);
+  ByteArray feed(const string &funcname, size_t bufsize,
+                 const Source &source);
+  void pure(const string &funcname);
+  void call(const string &funcname, const vector<string> &bufnames);
+  ByteArray pcall(const string &funcname, const string &bufname,
+                  size_t chunk_size, size_t result_size,
+                  const string &reduce_funcname);
+  ByteArray map_call(const string &funcname, size_t count,
+                     size_t in_stride, size_t out_stride,
+                     const ByteArray &input);
+  ByteArray graph(const ByteArray &spec, const vector<string> &outputs);
+  void compose(const string &name, const vector<string> &funcnames);
+  void alloc(const string &name, size_t size);
+  void free(const string &name);
+  ByteArray read(const string &name, size_t offset, size_t size);
+  void write(const string &name, size_t offset, const ByteArray &data);
   void import(const string &path);
 };
@@ -1,5 +1,13 @@
+#include <fstream>
+#include <unistd.h>
+
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/SHA256.h>
+
 #include "doctest.h"
 #include "compiler.h"
+#include "library.h"
 
 static const char *src_add = \
   "define i32 @add(i32, i32) {\n"
@@ -22,7 +30,10 @@ static const char *src_add_user =
   "}\n";
 
 ByteArray from_c_string(const char *str) {
-  return ByteArray(str, str+strlen(str));
+  // keep an invisible terminating zero, like read_payload() does
+  ByteArray result(str, str+strlen(str)+1);
+  result.pop_back();
+  return result;
 }
 
 TEST_CASE("CompileContext") {
@@ -35,6 +46,17 @@ TEST_CASE("CompileContext") {
   CHECK(response[0] == 5);
 }
 
+TEST_CASE("parse from a memory buffer") {
+  CompileContext cc;
+  auto buf = WritableMemoryBuffer::getNewUninitMemBuffer(strlen(src_add));
+  memcpy(buf->getBufferStart(), src_add, strlen(src_add));
+  cc.parse(std::move(buf));
+  cc.parse(from_c_string(src_add_user));
+  cc.link();
+  cc.commit();
+  CHECK(cc.call("add_user", 1)[0] == 5);
+}
+
 TEST_CASE("dump") {
   CompileContext cc;
   cc.parse(from_c_string(src_add));
@@ -42,6 +64,17 @@ TEST_CASE("dump") {
   cc.link();
   auto bitcode = cc.dump();
   CHECK(bitcode.size() > 0);
+  SUBCASE("dump in chunks") {
+    ByteArray chunked;
+    size_t chunks = 0;
+    cc.dump(100, [&](const char *data, size_t len) {
+      CHECK(len <= 100);
+      chunked.append(data, data + len);
+      chunks++;
+    });
+    CHECK(chunked == bitcode);
+    CHECK(chunks == (bitcode.size() + 99) / 100);
+  }
   SUBCASE("commit+call after dump") {
     cc.commit();
     auto response = cc.call("add_user", 1);
@@ -55,3 +88,1079 @@ TEST_CASE("dump") {
     CHECK(response[0] == 5);
   }
 }
+
+TEST_CASE("lazy bitcode") {
+  CompileContext cc;
+  cc.parse(from_c_string(src_add));
+  auto add_bitcode = cc.dump();
+  cc.parse(from_c_string(src_add_user));
+  auto user_bitcode = cc.dump();
+  CompileContext cc2;
+  // both the destination and the source of the link are lazy
+  cc2.parse(user_bitcode);
+  cc2.parse(add_bitcode);
+  cc2.link();
+  cc2.opt();
+  CHECK(cc2.dump().size() > 0);
+  cc2.commit();
+  CHECK(cc2.call("add_user", 1)[0] == 5);
+  CHECK_THROWS_AS(cc2.parse(ByteArray(user_bitcode.begin(),
+                                      user_bitcode.begin() + 40)),
+                  std::invalid_argument);
+}
+
+static const char *src_link_library = R"(
+define i8 @helper(i8 %x) {
+  %y = mul i8 %x, 3
+  ret i8 %y
+}
+
+define void @used(i8* %out) {
+  %x = load i8, i8* %out
+  %y = call i8 @helper(i8 %x)
+  %z = add i8 %y, 1
+  store i8 %z, i8* %out
+  ret void
+}
+
+define void @unused(i8* %out) {
+  store i8 2, i8* %out
+  ret void
+}
+)";
+
+static const char *src_link_user = R"(
+declare void @used(i8*)
+
+define void @link_user(i8* %out) {
+  store i8 2, i8* %out
+  call void @used(i8* %out)
+  ret void
+}
+)";
+
+TEST_CASE("link only the needed definitions") {
+  CompileContext cc;
+  cc.parse(from_c_string(src_link_library));
+  auto library_bitcode = cc.dump();
+  CompileContext cc2;
+  cc2.parse(library_bitcode);
+  cc2.parse(from_c_string(src_link_user));
+  cc2.link(true);
+  cc2.commit();
+  // helper is linked too, because used calls it
+  CHECK(cc2.call("link_user", 1)[0] == 7);
+  CHECK_THROWS_AS(cc2.call("unused", 1), std::invalid_argument);
+  CompileContext cc3;
+  cc3.parse(library_bitcode);
+  cc3.parse(from_c_string(src_link_user));
+  cc3.link();
+  cc3.commit();
+  CHECK(cc3.call("unused", 1)[0] == 2);
+  CHECK_THROWS_AS(cc3.link(true), std::underflow_error);
+}
+
+TEST_CASE("parse hash") {
+  char dir[] = "/tmp/compiler_test.XXXXXX";
+  REQUIRE(mkdtemp(dir));
+  string hash =
+    toHex(SHA256::hash(arrayRefFromStringRef(StringRef(src_add))), true);
+  {
+    CompileContext cc(dir);
+    CHECK(!cc.have(hash));
+    CHECK_THROWS_AS(cc.parse_hash(hash), std::invalid_argument);
+    CHECK_THROWS_AS(cc.parse_hash(hash, MemoryBuffer::getMemBufferCopy(
+                                          src_add_user)),
+                    std::invalid_argument);
+    cc.parse_hash(hash, MemoryBuffer::getMemBufferCopy(src_add));
+    CHECK(cc.have(hash));
+    cc.parse_hash(hash);
+    CHECK_THROWS_AS(cc.have("../etc/passwd"), std::invalid_argument);
+  }
+  // another session finds the module in the cache
+  CompileContext cc(dir);
+  CHECK(cc.have(hash));
+  cc.parse_hash(hash);
+  cc.parse(from_c_string(src_add_user));
+  cc.link();
+  cc.commit();
+  CHECK(cc.call("add_user", 1)[0] == 5);
+  sys::fs::remove_directories(dir);
+}
+
+TEST_CASE("parse many") {
+  CompileContext cc;
+  cc.parse(from_c_string(src_add));
+  auto add_bitcode = cc.dump();
+  string input = src_add_user;
+  input.append(add_bitcode.begin(), add_bitcode.end());
+  cc.parse_many(MemoryBuffer::getMemBufferCopy(input),
+                { strlen(src_add_user), add_bitcode.size() });
+  cc.link();
+  cc.commit();
+  CHECK(cc.call("add_user", 1)[0] == 5);
+  input = string(src_add) + "garbage";
+  CHECK_THROWS_AS(cc.parse_many(MemoryBuffer::getMemBufferCopy(input),
+                                { strlen(src_add), 7 }),
+                  std::invalid_argument);
+  CHECK_THROWS_AS(cc.parse_many(MemoryBuffer::getMemBufferCopy(input),
+                                { strlen(src_add), 8 }),
+                  std::invalid_argument);
+}
+
+static const char *src_accumulate =
+  "define void @accumulate(i32*, i32*) {\n"
+  "  %3 = load i32, i32* %0\n"
+  "  %4 = load i32, i32* %1\n"
+  "  %5 = add i32 %3, %4\n"
+  "  store i32 %5, i32* %1\n"
+  "  ret void\n"
+  "}\n";
+
+TEST_CASE("buffers") {
+  CompileContext cc;
+  cc.parse(from_c_string(src_accumulate));
+  cc.commit();
+  cc.alloc("step", 4);
+  cc.alloc("sum", 4);
+  cc.write("step", 0, ByteArray{3});
+  cc.call("accumulate", {"step", "sum"});
+  cc.call("accumulate", {"step", "sum"});
+  auto response = cc.read("sum", 0, 4);
+  CHECK(response[0] == 6);
+  CHECK(response[1] == 0);
+  CHECK_THROWS_AS(cc.alloc("sum", 4), std::invalid_argument);
+  CHECK_THROWS_AS(cc.read("sum", 2, 4), std::out_of_range);
+  cc.free("sum");
+  CHECK_THROWS_AS(cc.call("accumulate", {"step", "sum"}), std::invalid_argument);
+}
+
+static const char *src_sum_chunk =
+  "define void @sum_chunk(i8*, i64, i64*) {\n"
+  "entry:\n"
+  "  br label %loop\n"
+  "loop:\n"
+  "  %i = phi i64 [ 0, %entry ], [ %i.next, %loop ]\n"
+  "  %acc = phi i64 [ 0, %entry ], [ %acc.next, %loop ]\n"
+  "  %p = getelementptr i8, i8* %0, i64 %i\n"
+  "  %b = load i8, i8* %p\n"
+  "  %w = zext i8 %b to i64\n"
+  "  %acc.next = add i64 %acc, %w\n"
+  "  %i.next = add i64 %i, 1\n"
+  "  %done = icmp eq i64 %i.next, %1\n"
+  "  br i1 %done, label %exit, label %loop\n"
+  "exit:\n"
+  "  store i64 %acc.next, i64* %2\n"
+  "  ret void\n"
+  "}\n"
+  "define void @sum_reduce(i64*, i64*) {\n"
+  "  %3 = load i64, i64* %0\n"
+  "  %4 = load i64, i64* %1\n"
+  "  %5 = add i64 %3, %4\n"
+  "  store i64 %5, i64* %0\n"
+  "  ret void\n"
+  "}\n";
+
+TEST_CASE("pcall") {
+  CompileContext cc;
+  cc.parse(from_c_string(src_sum_chunk));
+  cc.commit();
+  cc.alloc("input", 10000);
+  cc.write("input", 0, ByteArray(10000, 1));
+  SUBCASE("map") {
+    auto response = cc.pcall("sum_chunk", "input", 4096, 8, "");
+    CHECK(response.size() == 3 * 8);
+    auto partials = reinterpret_cast<const int64_t *>(response.begin());
+    CHECK(partials[0] == 4096);
+    CHECK(partials[1] == 4096);
+    CHECK(partials[2] == 10000 - 2 * 4096);
+  }
+  SUBCASE("map-reduce") {
+    auto response = cc.pcall("sum_chunk", "input", 100, 8, "sum_reduce");
+    CHECK(response.size() == 8);
+    CHECK(*reinterpret_cast<const int64_t *>(response.begin()) == 10000);
+  }
+  SUBCASE("result size overflows") {
+    CHECK_THROWS_AS(cc.pcall("sum_chunk", "input", 2500, size_t(1) << 62, ""),
+                    std::invalid_argument);
+  }
+}
+
+static const char *src_square =
+  "define void @square(i32*, i32*) {\n"
+  "  %3 = load i32, i32* %0\n"
+  "  %4 = mul i32 %3, %3\n"
+  "  store i32 %4, i32* %1\n"
+  "  ret void\n"
+  "}\n";
+
+TEST_CASE("map") {
+  CompileContext cc;
+  cc.parse(from_c_string(src_square));
+  cc.commit();
+  vector<int32_t> input(100);
+  for (int i = 0; i < 100; i++) {
+    input[i] = i;
+  }
+  ByteArray in_bytes((const char *) input.data(),
+                     (const char *) (input.data() + input.size()));
+  for (int round = 0; round < 2; round++) {
+    auto response = cc.map_call("square", 100, 4, 8, in_bytes);
+    CHECK(response.size() == 800);
+    auto out = reinterpret_cast<const int32_t *>(response.begin());
+    CHECK(out[0] == 0);
+    CHECK(out[2 * 7] == 49);
+    CHECK(out[2 * 99] == 99 * 99);
+  }
+  CHECK_THROWS_AS(cc.map_call("square", size_t(1) << 62, 4, 4, ByteArray()),
+                  std::invalid_argument);
+  CHECK_THROWS_AS(cc.map_call("square", 10, 4, 8, in_bytes),
+                  std::invalid_argument);
+}
+
+static const char *src_pipeline =
+  "define i32 @load(i32*) {\n"
+  "  %2 = load i32, i32* %0\n"
+  "  ret i32 %2\n"
+  "}\n"
+  "define i32 @inc(i32) {\n"
+  "  %2 = add i32 %0, 1\n"
+  "  ret i32 %2\n"
+  "}\n"
+  "define i32 @twice(i32) {\n"
+  "  %2 = mul i32 %0, 2\n"
+  "  ret i32 %2\n"
+  "}\n"
+  "define void @init(i32*) {\n"
+  "  store i32 20, i32* %0\n"
+  "  ret void\n"
+  "}\n";
+
+static const char *src_pipeline_user =
+  "declare i32 @load_inc_twice(i32*)\n"
+  "define void @run(i32*) {\n"
+  "  %2 = call i32 @load_inc_twice(i32* %0)\n"
+  "  store i32 %2, i32* %0\n"
+  "  ret void\n"
+  "}\n";
+
+TEST_CASE("compose") {
+  CompileContext cc;
+  cc.parse(from_c_string(src_pipeline));
+  cc.commit();
+  cc.compose("load_inc_twice", {"load", "inc", "twice"});
+  cc.parse(from_c_string(src_pipeline_user));
+  cc.commit();
+  cc.compose("init_and_run", {"init", "run"});
+  auto response = cc.call("init_and_run", 4);
+  CHECK(response[0] == 42);
+  CHECK_THROWS_AS(cc.compose("bad", {"inc", "init"}), std::invalid_argument);
+  CHECK_THROWS_AS(cc.compose("inc", {"twice"}), std::invalid_argument);
+}
+
+static const char *src_add_v2 =
+  "define i32 @add(i32, i32) {\n"
+  "  %3 = add i32 %0, %1\n"
+  "  %4 = mul i32 %3, 10\n"
+  "  ret i32 %4\n"
+  "}\n";
+
+TEST_CASE("replace") {
+  CompileContext cc;
+  cc.parse(from_c_string(src_add));
+  cc.commit();
+  cc.parse(from_c_string(src_add_user));
+  cc.commit();
+  CHECK(cc.call("add_user", 1)[0] == 5);
+  cc.parse(from_c_string(src_add_v2));
+  CHECK_THROWS_AS(cc.commit(), std::invalid_argument);
+  cc.replace();
+  CHECK(cc.call("add_user", 1)[0] == 50);
+  cc.parse(from_c_string("define i32 @add(i32) {\n  ret i32 %0\n}\n"));
+  CHECK_THROWS_AS(cc.replace(), std::invalid_argument);
+  SUBCASE("composites are regenerated") {
+    CompileContext cc;
+    cc.parse(from_c_string(src_pipeline));
+    cc.commit();
+    cc.compose("load_inc_twice", {"load", "inc", "twice"});
+    cc.parse(from_c_string(src_pipeline_user));
+    cc.commit();
+    cc.compose("init_and_run", {"init", "run"});
+    cc.parse(from_c_string("define i32 @inc(i32) {\n"
+                           "  %2 = add i32 %0, 2\n"
+                           "  ret i32 %2\n"
+                           "}\n"));
+    cc.replace();
+    CHECK(cc.call("init_and_run", 4)[0] == 44);
+  }
+}
+
+// both modules define the inline function @h and the variable @k, as
+// C++ modules do for inline functions and templates
+static string src_inline_user(const string &name) {
+  return
+    "$h = comdat any\n"
+    "@k = linkonce_odr global i32 3\n"
+    "define linkonce_odr i32 @h() comdat {\n"
+    "  %1 = load i32, i32* @k\n"
+    "  ret i32 %1\n"
+    "}\n"
+    "define void @" + name + "(i32*) {\n"
+    "  %2 = call i32 @h()\n"
+    "  store i32 %2, i32* %0\n"
+    "  ret void\n"
+    "}\n";
+}
+
+TEST_CASE("commit linkonce_odr definitions twice") {
+  CompileContext cc;
+  cc.parse(from_c_string(src_inline_user("f").c_str()));
+  cc.commit();
+  cc.parse(from_c_string(src_inline_user("g").c_str()));
+  cc.commit();
+  CHECK(cc.call("f", 4)[0] == 3);
+  CHECK(cc.call("g", 4)[0] == 3);
+  cc.parse(from_c_string("define i32 @h() {\n  ret i32 0\n}\n"));
+  CHECK_THROWS_AS(cc.commit(), std::invalid_argument);
+}
+
+// MAP and COMPOSE inline @h into the kernels of @e and @g
+static string src_inlined_callee(int step) {
+  return
+    "define i32 @h(i32 %x) {\n"
+    "  %y = add i32 %x, " + to_string(step) + "\n"
+    "  ret i32 %y\n"
+    "}\n";
+}
+
+static const char *src_inlining_callers =
+  "declare i32 @h(i32)\n"
+  "define void @e(i32* %in, i32* %out) {\n"
+  "  %x = load i32, i32* %in\n"
+  "  %y = call i32 @h(i32 %x)\n"
+  "  store i32 %y, i32* %out\n"
+  "  ret void\n"
+  "}\n"
+  "define void @g(i32* %p) {\n"
+  "  %x = load i32, i32* %p\n"
+  "  %y = call i32 @h(i32 %x)\n"
+  "  store i32 %y, i32* %p\n"
+  "  ret void\n"
+  "}\n";
+
+TEST_CASE("replacing an inlined callee regenerates kernels") {
+  CompileContext cc;
+  cc.parse(from_c_string(src_inlined_callee(10).c_str()));
+  cc.parse(from_c_string(src_inlining_callers));
+  cc.link();
+  cc.commit();
+  cc.compose("cg", {"g"});
+  ByteArray input{5, 0, 0, 0};
+  CHECK(cc.map_call("e", 1, 4, 4, input)[0] == 15);
+  CHECK(cc.call("cg", 4, input)[0] == 15);
+  cc.parse(from_c_string(src_inlined_callee(20).c_str()));
+  cc.replace();
+  CHECK(cc.map_call("e", 1, 4, 4, input)[0] == 25);
+  CHECK(cc.call("cg", 4, input)[0] == 25);
+}
+
+TEST_CASE("only the definitions a kernel reaches are fused") {
+  CompileContext cc;
+  cc.parse(from_c_string(src_inlined_callee(10).c_str()));
+  cc.parse(from_c_string(src_inlining_callers));
+  cc.link();
+  cc.commit();
+  cc.compose("cg", {"g"});
+  // e is not fused into cg, so it may use local state
+  cc.parse(from_c_string("@n = internal global i32 0\n"
+                         "define void @e(i32* %in, i32* %out) {\n"
+                         "  store i32 1, i32* @n\n"
+                         "  ret void\n"
+                         "}\n"));
+  cc.replace();
+  ByteArray input{5, 0, 0, 0};
+  CHECK(cc.call("cg", 4, input)[0] == 15);
+}
+
+// count is unchanged in the second version, so it keeps counting
+static const char *src_count_versions[] = {
+  "@n = internal global i32 0\n"
+  "define void @count(i32*) {\n"
+  "  %2 = load i32, i32* @n\n"
+  "  %3 = add i32 %2, 1\n"
+  "  store i32 %3, i32* @n\n"
+  "  store i32 %3, i32* %0\n"
+  "  ret void\n"
+  "}\n"
+  "define void @version(i32*) {\n"
+  "  store i32 1, i32* %0\n"
+  "  ret void\n"
+  "}\n",
+  "@n = internal global i32 0\n"
+  "define void @count(i32*) {\n"
+  "  %2 = load i32, i32* @n\n"
+  "  %3 = add i32 %2, 1\n"
+  "  store i32 %3, i32* @n\n"
+  "  store i32 %3, i32* %0\n"
+  "  ret void\n"
+  "}\n"
+  "define void @version(i32*) {\n"
+  "  store i32 2, i32* %0\n"
+  "  ret void\n"
+  "}\n",
+};
+
+TEST_CASE("replace only changed functions") {
+  CompileContext cc;
+  cc.parse(from_c_string(src_count_versions[0]));
+  cc.commit();
+  CHECK(cc.call("count", 4)[0] == 1);
+  cc.parse(from_c_string(src_count_versions[1]));
+  cc.replace();
+  CHECK(cc.call("version", 4)[0] == 2);
+  CHECK(cc.call("count", 4)[0] == 2);
+}
+
+// inc is unchanged in the second version, but shares @n with get
+static string src_shared_local_version(int version) {
+  return
+    "@n = internal global i32 0\n"
+    "define void @inc(i32*) {\n"
+    "  %2 = load i32, i32* @n\n"
+    "  %3 = add i32 %2, 10\n"
+    "  store i32 %3, i32* @n\n"
+    "  ret void\n"
+    "}\n"
+    "define void @get(i32*) {\n"
+    "  %2 = load i32, i32* @n\n"
+    "  %3 = add i32 %2, " + to_string(version - 1) + "\n"
+    "  store i32 %3, i32* %0\n"
+    "  ret void\n"
+    "}\n";
+}
+
+TEST_CASE("replace functions sharing local variables together") {
+  CompileContext cc;
+  cc.parse(from_c_string(src_shared_local_version(1).c_str()));
+  cc.commit();
+  cc.call("inc", 4);
+  cc.call("inc", 4);
+  CHECK(cc.call("get", 4)[0] == 20);
+  cc.parse(from_c_string(src_shared_local_version(2).c_str()));
+  cc.replace();
+  cc.call("inc", 4);
+  CHECK(cc.call("get", 4)[0] == 11);
+}
+
+// the versions only differ in the contents of the !range metadata
+static string src_range_version(int high) {
+  return
+    "@x = global i32 4\n"
+    "define void @f(i32*) {\n"
+    "  %2 = load i32, i32* @x, !range !0\n"
+    "  %3 = and i32 %2, 4\n"
+    "  store i32 %3, i32* %0\n"
+    "  ret void\n"
+    "}\n"
+    "!0 = !{i32 0, i32 " + to_string(high) + "}\n";
+}
+
+TEST_CASE("replace functions whose metadata changed") {
+  CompileContext cc;
+  cc.parse(from_c_string(src_range_version(8).c_str()));
+  cc.commit();
+  CHECK(cc.call("f", 4)[0] == 4);
+  cc.parse(from_c_string(src_range_version(2).c_str()));
+  cc.replace();
+  CHECK(cc.call("f", 4)[0] == 0);
+  CompileContext fresh;
+  fresh.parse(from_c_string(src_range_version(2).c_str()));
+  fresh.commit();
+  CHECK(fresh.call("f", 4)[0] == 0);
+}
+
+TEST_CASE("functions with local state are not fused") {
+  CompileContext cc;
+  cc.parse(from_c_string(src_count_versions[0]));
+  cc.commit();
+  CHECK_THROWS_AS(cc.compose("c", {"count"}), std::invalid_argument);
+  CHECK_THROWS_AS(cc.map_call("count", 2, 0, 4, ByteArray()),
+                  std::invalid_argument);
+  // nor are replacements of the parts of composites
+  cc.compose("v", {"version"});
+  cc.parse(from_c_string("@m = internal global i32 0\n"
+                         "define void @version(i32*) {\n"
+                         "  store i32 3, i32* @m\n"
+                         "  ret void\n"
+                         "}\n"));
+  CHECK_THROWS_AS(cc.replace(), std::invalid_argument);
+  CHECK(cc.call("v", 4)[0] == 1);
+}
+
+TEST_CASE("patch") {
+  CompileContext cc;
+  cc.parse(from_c_string(src_count_versions[0]));
+  auto hash = cc.commit();
+  CHECK(hash.size() == 32);
+  cc.parse(from_c_string(
+    "define void @version(i32*) {\n"
+    "  store i32 3, i32* %0\n"
+    "  ret void\n"
+    "}\n"
+    "define void @added(i32*) {\n"
+    "  store i32 4, i32* %0\n"
+    "  ret void\n"
+    "}\n"));
+  auto patched = cc.patch(hash, {});
+  CHECK(patched != hash);
+  CHECK(cc.call("version", 4)[0] == 3);
+  CHECK(cc.call("added", 4)[0] == 4);
+  cc.parse(from_c_string(""));
+  CHECK_THROWS_AS(cc.patch(hash, {}), std::invalid_argument);
+  cc.parse(from_c_string(""));
+  CHECK_THROWS_AS(cc.patch(patched, {"missing"}), std::invalid_argument);
+  cc.parse(from_c_string(""));
+  auto removed = cc.patch(patched, {"added"});
+  CHECK(removed != patched);
+  CHECK_THROWS_AS(cc.call("added", 4), std::invalid_argument);
+  // a removed function can be committed again
+  cc.parse(from_c_string(
+    "define void @added(i32*) {\n"
+    "  store i32 5, i32* %0\n"
+    "  ret void\n"
+    "}\n"));
+  cc.commit();
+  CHECK(cc.call("added", 4)[0] == 5);
+  // variables keep their storage, so they cannot be removed
+  cc.parse(from_c_string("@v = global i32 1\n"));
+  auto with_v = cc.patch(removed, {});
+  cc.parse(from_c_string(""));
+  CHECK_THROWS_AS(cc.patch(with_v, {"v"}), std::invalid_argument);
+}
+
+TEST_CASE("watch") {
+  char path[] = "/tmp/compiler_test.XXXXXX";
+  close(mkstemp(path));
+  CompileContext cc;
+  ofstream(path) << src_count_versions[0];
+  auto hash = cc.watch(path);
+  CHECK(cc.call("version", 4)[0] == 1);
+  CHECK(cc.call("count", 4)[0] == 1);
+  ofstream(path) << src_count_versions[1];
+  CHECK(cc.watch(path) != hash);
+  CHECK(cc.call("version", 4)[0] == 2);
+  CHECK(cc.call("count", 4)[0] == 2);
+  ofstream(path) << "garbage";
+  CHECK_THROWS_AS(cc.watch(path), std::invalid_argument);
+  CHECK(cc.call("version", 4)[0] == 2);
+  unlink(path);
+}
+
+TEST_CASE("parse and dump files") {
+  char path[] = "/tmp/compiler_test.XXXXXX";
+  close(mkstemp(path));
+  CompileContext cc;
+  ofstream(path) << src_count_versions[0];
+  cc.parse_file(path);
+  auto bitcode = cc.dump();
+  cc.dump_file(path);
+  auto written = MemoryBuffer::getFile(path);
+  REQUIRE(written);
+  CHECK((*written)->getBuffer() == StringRef(bitcode.data(), bitcode.size()));
+  cc.parse_file(path);
+  cc.commit();
+  CHECK(cc.call("version", 4)[0] == 1);
+  unlink(path);
+  CHECK_THROWS_AS(cc.parse_file(path), std::invalid_argument);
+  CHECK_THROWS_AS(cc.dump_file("/nonexistent/module.bc"),
+                  std::invalid_argument);
+}
+
+TEST_CASE("library") {
+  char dir[] = "/tmp/compiler_test.XXXXXX";
+  REQUIRE(mkdtemp(dir));
+  string path(dir);
+  ofstream(path + "/a.ll") <<
+    "declare i32 @inc(i32)\n"
+    "define i32 @twice(i32 %x) {\n"
+    "  %y = call i32 @inc(i32 %x)\n"
+    "  %z = call i32 @inc(i32 %y)\n"
+    "  ret i32 %z\n"
+    "}\n";
+  ofstream(path + "/b.ll") <<
+    "@step = global i32 1\n"
+    "define i32 @inc(i32 %x) {\n"
+    "  %s = load i32, i32* @step\n"
+    "  %y = add i32 %x, %s\n"
+    "  ret i32 %y\n"
+    "}\n";
+  ofstream(path + "/c.ll") <<
+    "define void @unused(i32*) {\n"
+    "  ret void\n"
+    "}\n";
+  ofstream(path + "/README") << "not a module";
+  Library library(path);
+  CHECK(library.size() == 4);
+  REQUIRE(library.find("inc"));
+  CHECK(*library.find("inc") == path + "/b.ll");
+  CHECK_FALSE(library.find("missing"));
+
+  CompileContext cc("", &library);
+  cc.parse(from_c_string(
+    "declare i32 @twice(i32)\n"
+    "define void @f(i32*) {\n"
+    "  %x = load i32, i32* %0\n"
+    "  %y = call i32 @twice(i32 %x)\n"
+    "  store i32 %y, i32* %0\n"
+    "  ret void\n"
+    "}\n"));
+  cc.commit();
+  ByteArray input(4, 0);
+  input[0] = 40;
+  CHECK(cc.call("f", 4, input)[0] == 42);
+  CHECK_THROWS_AS(cc.call("unused", 4), std::invalid_argument);
+
+  // a definition of the session is not taken from the library
+  CompileContext cc2("", &library);
+  cc2.parse(from_c_string(
+    "@step = global i32 5\n"
+    "declare i32 @inc(i32)\n"
+    "define void @g(i32*) {\n"
+    "  %x = call i32 @inc(i32 0)\n"
+    "  store i32 %x, i32* %0\n"
+    "  ret void\n"
+    "}\n"));
+  cc2.commit();
+  CHECK(cc2.call("g", 4)[0] == 5);
+
+  // the module stays on the stack if a library file cannot be loaded
+  ofstream(path + "/c.ll") << "garbage";
+  cc2.parse(from_c_string(
+    "declare void @unused(i32*)\n"
+    "define void @h(i32* %p) {\n"
+    "  call void @unused(i32* %p)\n"
+    "  ret void\n"
+    "}\n"));
+  CHECK_THROWS_AS(cc2.commit(), std::invalid_argument);
+  ofstream(path + "/c.ll") <<
+    "define void @unused(i32*) {\n"
+    "  ret void\n"
+    "}\n";
+  cc2.commit();
+  CHECK(cc2.call("h", 4)[0] == 0);
+  for (auto name : { "a.ll", "b.ll", "c.ll", "README" }) {
+    unlink((path + "/" + name).c_str());
+  }
+  rmdir(dir);
+}
+
+static const char *src_spin =
+  "@running = global i32 0\n"
+  "@go = global i32 0\n"
+  "define void @is_running(i32*) {\n"
+  "  %2 = load atomic i32, i32* @running monotonic, align 4\n"
+  "  store i32 %2, i32* %0\n"
+  "  ret void\n"
+  "}\n"
+  "define void @start(i32*) {\n"
+  "  store atomic i32 1, i32* @go monotonic, align 4\n"
+  "  ret void\n"
+  "}\n"
+  "define void @spin(i32*) {\n"
+  "  ret void\n"
+  "}\n";
+
+// spin until @go is set, then store the version number
+static string src_spin_version(int version) {
+  return
+    "@running = external global i32\n"
+    "@go = external global i32\n"
+    "define void @spin(i32*) {\n"
+    "entry:\n"
+    "  store atomic i32 1, i32* @running monotonic, align 4\n"
+    "  br label %loop\n"
+    "loop:\n"
+    "  %go = load atomic i32, i32* @go monotonic, align 4\n"
+    "  %wait = icmp eq i32 %go, 0\n"
+    "  br i1 %wait, label %loop, label %done\n"
+    "done:\n"
+    "  store i32 " + to_string(version) + ", i32* %0\n"
+    "  ret void\n"
+    "}\n";
+}
+
+TEST_CASE("replace under a running call") {
+  CompileContext cc;
+  cc.parse(from_c_string(src_spin));
+  cc.commit();
+  for (int version = 1; version <= 2; version++) {
+    cc.parse(from_c_string(src_spin_version(version).c_str()));
+    cc.replace();
+  }
+  cc.async_call("spin", 4, ByteArray(), "spinning");
+  while (cc.call("is_running", 4)[0] == 0) {
+    std::this_thread::yield();
+  }
+  // the running version is released only after the call has finished
+  for (int version = 3; version <= 4; version++) {
+    cc.parse(from_c_string(src_spin_version(version).c_str()));
+    cc.replace();
+  }
+  cc.call("start", 4);
+  CHECK(cc.await("spinning")[0] == 2);
+  CHECK(cc.call("spin", 4)[0] == 4);
+}
+
+static const char *src_graph =
+  "define void @set1(i32*) {\n"
+  "  store i32 1, i32* %0\n"
+  "  ret void\n"
+  "}\n"
+  "define void @set2(i32*) {\n"
+  "  store i32 2, i32* %0\n"
+  "  ret void\n"
+  "}\n"
+  "define void @sum(i32*, i32*, i32*) {\n"
+  "  %4 = load i32, i32* %0\n"
+  "  %5 = load i32, i32* %1\n"
+  "  %6 = add i32 %4, %5\n"
+  "  store i32 %6, i32* %2\n"
+  "  ret void\n"
+  "}\n";
+
+TEST_CASE("graph") {
+  CompileContext cc;
+  cc.parse(from_c_string(src_graph));
+  cc.commit();
+  cc.alloc("a", 4);
+  cc.alloc("b", 4);
+  cc.alloc("c", 4);
+  cc.alloc("d", 4);
+  auto response = cc.graph(from_c_string(
+    "set1 -> a\n"
+    "set2 -> b\n"
+    "sum a b -> c\n"
+    "sum c c -> d\n"
+    "sum c d -> a\n"), {"a", "d"});
+  CHECK(response.size() == 8);
+  CHECK(response[0] == 9);
+  CHECK(response[4] == 6);
+  CHECK_THROWS_AS(cc.graph(from_c_string("sum a b -> e\n"), {}),
+                  std::invalid_argument);
+}
+
+static const char *src_counter =
+  "@calls = global i32 0\n"
+  "define void @count(i32*) {\n"
+  "  %2 = load i32, i32* @calls\n"
+  "  %3 = add i32 %2, 1\n"
+  "  store i32 %3, i32* @calls\n"
+  "  %4 = load i32, i32* %0\n"
+  "  %5 = add i32 %4, %3\n"
+  "  store i32 %5, i32* %0\n"
+  "  ret void\n"
+  "}\n";
+
+TEST_CASE("pure call cache") {
+  CompileContext cc;
+  cc.parse(from_c_string(src_counter));
+  cc.commit();
+  ByteArray input{10};
+  CHECK(cc.call("count", 4, input)[0] == 11);
+  CHECK(cc.call("count", 4, input)[0] == 12);
+  // pretend it is pure: repeated calls return the cached result
+  cc.pure("count");
+  CHECK(cc.call("count", 4, input)[0] == 13);
+  CHECK(cc.call("count", 4, input)[0] == 13);
+  CHECK(cc.call("count", 4, ByteArray{20})[0] == 24);
+  CHECK(cc.call("count", 8, input)[0] == 15);
+  CHECK_THROWS_AS(cc.call("count", 4, ByteArray(5)), std::invalid_argument);
+  CHECK_THROWS_AS(cc.pure("missing"), std::invalid_argument);
+}
+
+static const char *src_square_in_place =
+  "define void @square_in_place(i32*) {\n"
+  "  %2 = load i32, i32* %0\n"
+  "  %3 = mul i32 %2, %2\n"
+  "  store i32 %3, i32* %0\n"
+  "  ret void\n"
+  "}\n";
+
+TEST_CASE("inferred purity") {
+  CompileContext cc;
+  cc.parse(from_c_string(src_square_in_place));
+  cc.parse(from_c_string(src_counter));
+  cc.link();
+  cc.opt();
+  cc.commit();
+  ByteArray input{3};
+  CHECK(cc.call("square_in_place", 4, input)[0] == 9);
+  CHECK(cc.call("square_in_place", 4, input)[0] == 9);
+  // count has side effects, so it is never cached
+  CHECK(cc.call("count", 4, input)[0] == 4);
+  CHECK(cc.call("count", 4, input)[0] == 5);
+}
+
+static const char *src_generator =
+  "declare token @llvm.coro.id(i32, i8*, i8*, i8*)\n"
+  "declare i32 @llvm.coro.size.i32()\n"
+  "declare i8* @llvm.coro.begin(token, i8*)\n"
+  "declare i8 @llvm.coro.suspend(token, i1)\n"
+  "declare i8* @llvm.coro.free(token, i8*)\n"
+  "declare i1 @llvm.coro.end(i8*, i1)\n"
+  "declare i8* @malloc(i32)\n"
+  "declare void @free(i8*)\n"
+  "define i8* @count_to_3(i32* %buf) \"coroutine.presplit\"=\"0\" {\n"
+  "entry:\n"
+  "  %id = call token @llvm.coro.id(i32 0, i8* null, i8* null, i8* null)\n"
+  "  %size = call i32 @llvm.coro.size.i32()\n"
+  "  %alloc = call i8* @malloc(i32 %size)\n"
+  "  %hdl = call i8* @llvm.coro.begin(token %id, i8* %alloc)\n"
+  "  %start = load i32, i32* %buf\n"
+  "  br label %loop\n"
+  "loop:\n"
+  "  %n = phi i32 [ %start, %entry ], [ %inc, %resume ]\n"
+  "  store i32 %n, i32* %buf\n"
+  "  %sp = call i8 @llvm.coro.suspend(token none, i1 false)\n"
+  "  switch i8 %sp, label %suspend [i8 0, label %resume\n"
+  "                                 i8 1, label %cleanup]\n"
+  "resume:\n"
+  "  %inc = add i32 %n, 1\n"
+  "  %done = icmp eq i32 %inc, 3\n"
+  "  br i1 %done, label %final, label %loop\n"
+  "final:\n"
+  "  %fs = call i8 @llvm.coro.suspend(token none, i1 true)\n"
+  "  switch i8 %fs, label %suspend [i8 0, label %cleanup\n"
+  "                                 i8 1, label %cleanup]\n"
+  "cleanup:\n"
+  "  %mem = call i8* @llvm.coro.free(token %id, i8* %hdl)\n"
+  "  call void @free(i8* %mem)\n"
+  "  br label %suspend\n"
+  "suspend:\n"
+  "  %unused = call i1 @llvm.coro.end(i8* %hdl, i1 false)\n"
+  "  ret i8* %hdl\n"
+  "}\n";
+
+TEST_CASE("coroutines") {
+  CompileContext cc;
+  cc.parse(from_c_string(src_generator));
+  SUBCASE("lowered by OPT") {
+    cc.opt();
+  }
+  SUBCASE("lowered by COMMIT") {
+  }
+  cc.commit();
+  CHECK(cc.call("count_to_3", 4, ByteArray(), "gen")[0] == 0);
+  CHECK(cc.resume("gen")[0] == 1);
+  CHECK(cc.resume("gen")[0] == 2);
+  CHECK(cc.resume("gen").empty());
+  CHECK_THROWS_AS(cc.resume("gen"), std::invalid_argument);
+  // without a handle only the first chunk is returned
+  CHECK(cc.call("count_to_3", 4, ByteArray{1})[0] == 1);
+  // destroy a suspended coroutine
+  CHECK(cc.call("count_to_3", 4, ByteArray{2}, "gen")[0] == 2);
+  CHECK_THROWS_AS(cc.alloc("gen", 4), std::invalid_argument);
+  cc.free("gen");
+  // a coroutine left suspended is destroyed with the session
+  CHECK(cc.call("count_to_3", 4, ByteArray(), "gen")[0] == 0);
+}
+
+static const char *src_emit_triples =
+  "define void @emit_triples(i8* %ctx, void (i8*, i8*, i64)* %emit) {\n"
+  "entry:\n"
+  "  %buf = alloca [3 x i8]\n"
+  "  %p0 = getelementptr [3 x i8], [3 x i8]* %buf, i64 0, i64 0\n"
+  "  %p1 = getelementptr [3 x i8], [3 x i8]* %buf, i64 0, i64 1\n"
+  "  %p2 = getelementptr [3 x i8], [3 x i8]* %buf, i64 0, i64 2\n"
+  "  br label %loop\n"
+  "loop:\n"
+  "  %i = phi i8 [ 0, %entry ], [ %next, %loop ]\n"
+  "  store i8 %i, i8* %p0\n"
+  "  store i8 %i, i8* %p1\n"
+  "  store i8 %i, i8* %p2\n"
+  "  call void %emit(i8* %ctx, i8* %p0, i64 3)\n"
+  "  %next = add i8 %i, 1\n"
+  "  %done = icmp eq i8 %next, 10\n"
+  "  br i1 %done, label %exit, label %loop\n"
+  "exit:\n"
+  "  ret void\n"
+  "}\n";
+
+TEST_CASE("stream") {
+  CompileContext cc;
+  cc.parse(from_c_string(src_emit_triples));
+  cc.commit();
+  vector<size_t> sizes;
+  ByteArray result;
+  cc.stream("emit_triples", 4, [&](const char *data, size_t len) {
+    sizes.push_back(len);
+    result.append(data, data + len);
+  });
+  CHECK(sizes.size() == 8);
+  CHECK(sizes.front() == 4);
+  CHECK(sizes.back() == 2);
+  CHECK(result.size() == 30);
+  CHECK(result[0] == 0);
+  CHECK(result[29] == 9);
+  SUBCASE("sink errors") {
+    int calls = 0;
+    CHECK_THROWS_AS(cc.stream("emit_triples", 2, [&](const char *, size_t) {
+      calls++;
+      throw std::invalid_argument("sink failure");
+    }), std::invalid_argument);
+    CHECK(calls == 1);
+  }
+}
+
+static const char *src_byte_sum =
+  "define void @byte_sum(i64* %buf, i8* %data, i64 %len) {\n"
+  "entry:\n"
+  "  %empty = icmp eq i64 %len, 0\n"
+  "  br i1 %empty, label %exit, label %loop\n"
+  "loop:\n"
+  "  %i = phi i64 [ 0, %entry ], [ %next, %loop ]\n"
+  "  %p = getelementptr i8, i8* %data, i64 %i\n"
+  "  %b = load i8, i8* %p\n"
+  "  %w = zext i8 %b to i64\n"
+  "  %acc = load i64, i64* %buf\n"
+  "  %sum = add i64 %acc, %w\n"
+  "  store i64 %sum, i64* %buf\n"
+  "  %next = add i64 %i, 1\n"
+  "  %done = icmp eq i64 %next, %len\n"
+  "  br i1 %done, label %exit, label %loop\n"
+  "exit:\n"
+  "  ret void\n"
+  "}\n";
+
+TEST_CASE("feed") {
+  CompileContext cc;
+  cc.parse(from_c_string(src_byte_sum));
+  cc.commit();
+  int chunks = 0;
+  auto response = cc.feed("byte_sum", 8, [&](ByteArray &chunk) {
+    if (chunks == 100) {
+      return false;
+    }
+    chunk.assign(1000, chunks++ % 2 + 1);
+    return true;
+  });
+  CHECK(*reinterpret_cast<const int64_t *>(response.begin()) == 150000);
+  SUBCASE("source errors") {
+    CHECK_THROWS_AS(cc.feed("byte_sum", 8, [&](ByteArray &chunk) -> bool {
+      throw std::invalid_argument("source failure");
+    }), std::invalid_argument);
+  }
+}
+
+static const char *src_run_once =
+  "declare i64 @strlen(i8*)\n"
+  "@greeting = constant [6 x i8] c\"hello\\00\"\n"
+  "define void @measure(i64*) cold {\n"
+  "  %2 = getelementptr [6 x i8], [6 x i8]* @greeting, i64 0, i64 0\n"
+  "  %3 = call i64 @strlen(i8* %2)\n"
+  "  %4 = load i64, i64* %0\n"
+  "  %5 = add i64 %3, %4\n"
+  "  store i64 %5, i64* %0\n"
+  "  ret void\n"
+  "}\n";
+
+TEST_CASE("interpreter") {
+  CompileContext cc;
+  cc.parse(from_c_string(src_run_once));
+  cc.commit();
+  cc.parse(from_c_string(src_counter));
+  cc.commit();
+  ByteArray input{10};
+  // interpreted first, compiled afterwards
+  CHECK(cc.call("measure", 8, input)[0] == 15);
+  CHECK(cc.call("measure", 8, input)[0] == 15);
+  CHECK(cc.call("measure", 8, input, "", true)[0] == 15);
+  // modules with mutable state are always compiled
+  CHECK(cc.call("count", 4, input, "", true)[0] == 11);
+  CHECK(cc.call("count", 4, input)[0] == 12);
+  CHECK_THROWS_AS(cc.call("nosuch", 4, input, "", true),
+                  std::invalid_argument);
+}
+
+// the interpreter has its own copy of @c, so the address tells which
+// engine ran the function
+static const char *src_where =
+  "@c = constant i32 7\n"
+  "define void @where(i64*) cold {\n"
+  "  store i64 ptrtoint (i32* @c to i64), i64* %0\n"
+  "  ret void\n"
+  "}\n";
+
+TEST_CASE("interpreter runs cold functions") {
+  CompileContext cc;
+  cc.parse(from_c_string(src_where));
+  cc.commit();
+  auto address = [&](bool interpret) {
+    uint64_t addr;
+    auto result = cc.call("where", 8, ByteArray(), "", interpret);
+    memcpy(&addr, result.data(), 8);
+    return addr;
+  };
+  auto interpreted = address(false);
+  auto compiled = address(false);
+  CHECK(interpreted != compiled);
+  CHECK(address(false) == compiled);
+  CHECK(address(true) != compiled);
+}
+
+// the interpreter cannot run llvm.fshl
+static const char *src_intrinsics =
+  "declare i32 @llvm.fshl.i32(i32, i32, i32)\n"
+  "define void @rot(i32*) cold {\n"
+  "  %2 = load i32, i32* %0\n"
+  "  %3 = call i32 @llvm.fshl.i32(i32 %2, i32 %2, i32 8)\n"
+  "  store i32 %3, i32* %0\n"
+  "  ret void\n"
+  "}\n";
+
+// but it can run llvm.ctpop
+static const char *src_where_ctpop =
+  "@c = constant i32 7\n"
+  "declare i64 @llvm.ctpop.i64(i64)\n"
+  "define void @where(i64*) cold {\n"
+  "  %2 = call i64 @llvm.ctpop.i64(i64 ptrtoint (i32* @c to i64))\n"
+  "  store i64 ptrtoint (i32* @c to i64), i64* %0\n"
+  "  ret void\n"
+  "}\n";
+
+TEST_CASE("interpreter and intrinsics") {
+  CompileContext cc;
+  cc.parse(from_c_string(src_intrinsics));
+  cc.commit();
+  ByteArray input{4, 3, 2, 1};
+  auto result = cc.call("rot", 4, input);
+  CHECK(result == ByteArray({1, 4, 3, 2}));
+  cc.parse(from_c_string(src_where_ctpop));
+  cc.commit();
+  auto address = [&] {
+    uint64_t addr;
+    memcpy(&addr, cc.call("where", 8).data(), 8);
+    return addr;
+  };
+  auto interpreted = address();
+  CHECK(address() != interpreted);
+}
+
+TEST_CASE("async calls") {
+  CompileContext cc;
+  cc.parse(from_c_string(src_counter));
+  cc.commit();
+  cc.async_call("count", 4, ByteArray{10}, "first");
+  cc.async_call("count", 4, ByteArray{20}, "second");
+  CHECK_THROWS_AS(cc.async_call("count", 4, ByteArray(), "first"),
+                  std::invalid_argument);
+  // compile while the calls run
+  cc.parse(from_c_string(src_add));
+  cc.parse(from_c_string(src_add_user));
+  cc.link();
+  cc.commit();
+  CHECK(cc.call("add_user", 1)[0] == 5);
+  CHECK(cc.await("second")[0] == 22);
+  CHECK(cc.await("first")[0] == 11);
+  CHECK_THROWS_AS(cc.await("first"), std::invalid_argument);
+}
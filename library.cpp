@@ -0,0 +1,54 @@
+#include <algorithm>
+#include <stdexcept>
+#include <vector>
+
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/Module.h>
+#include <llvm/IRReader/IRReader.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/SourceMgr.h>
+
+#include "library.h"
+
+using namespace llvm;
+
+// bitcode is loaded lazily, so only the symbol tables are read
+Library::Library(const string &dir) {
+  vector<string> paths;
+  std::error_code ec;
+  for (sys::fs::directory_iterator it(dir, ec), end; it != end && !ec;
+       it.increment(ec)) {
+    auto ext = sys::path::extension(it->path());
+    if (it->type() != sys::fs::file_type::regular_file &&
+        it->type() != sys::fs::file_type::symlink_file) {
+      continue;
+    }
+    if (ext == ".bc" || ext == ".ll") {
+      paths.push_back(it->path());
+    }
+  }
+  if (ec) {
+    throw std::runtime_error(dir + ": " + ec.message());
+  }
+  std::sort(paths.begin(), paths.end());
+  LLVMContext ctx;
+  for (auto &path : paths) {
+    SMDiagnostic err;
+    auto mod = getLazyIRFileModule(path, err, ctx);
+    if (!mod) {
+      throw std::runtime_error(path + ": " + err.getMessage().str());
+    }
+    for (auto &gv : mod->global_values()) {
+      if (!gv.isDeclaration() && !gv.hasLocalLinkage() &&
+          !gv.hasAvailableExternallyLinkage()) {
+        files_.insert({ gv.getName().str(), path });
+      }
+    }
+  }
+}
+
+const string *Library::find(const string &symbol) const {
+  auto it = files_.find(symbol);
+  return it == files_.end() ? nullptr : &it->second;
+}
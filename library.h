@@ -0,0 +1,21 @@
+#include <map>
+#include <string>
+
+using namespace std;
+
+// an index of the modules in a directory by the symbols they define
+//
+// the modules are loaded on demand for the symbols which committed
+// modules leave unresolved, like the members of a static archive
+class Library {
+  // the file defining each symbol; the first file in name order wins
+  map<string, string> files_;
+
+public:
+  // index the bitcode (.bc) and assembly (.ll) files in dir
+  explicit Library(const string &dir);
+
+  // the path of the file defining symbol, or null
+  const string *find(const string &symbol) const;
+  size_t size() const { return files_.size(); }
+};
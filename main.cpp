@@ -1,7 +1,35 @@
+#include <iostream>
+#include <unistd.h>
+
 #include "server.h"
 
+static void usage(const char *argv0)
+{
+  cerr << "usage: " << argv0
+       << " [-s <spool_threshold>] [-c <cache_dir>] [-l <library_dir>]"
+       << endl;
+}
+
 int main(int argc, char **argv)
 {
-  LLVMServer server("127.0.0.1", 4000);
+  LLVMServerOptions options;
+  int opt;
+  while ((opt = getopt(argc, argv, "s:c:l:")) != -1) {
+    switch (opt) {
+    case 's':
+      options.spool_threshold = stoull(optarg);
+      break;
+    case 'c':
+      options.cache_dir = optarg;
+      break;
+    case 'l':
+      options.library_dir = optarg;
+      break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  LLVMServer server("127.0.0.1", 4000, options);
   return server.start();
 }
@@ -1,29 +1,71 @@
 #include <iostream>
+#include <limits>
+#include <mutex>
+#include <unistd.h>
 #include <boost/algorithm/string.hpp>
+#include <llvm/Support/Compression.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Path.h>
 
 #include "server.h"
 #include "compiler.h"
+#include "library.h"
+#include "watcher.h"
 
 using namespace std;
 
+// a payload spooled to an unlinked temporary file and mapped into
+// memory, so the kernel can page it out instead of keeping it on the
+// heap
+//
+// the file is one byte longer than the payload, so the buffer is
+// null-terminated
+class SpooledPayload : public MemoryBuffer {
+  sys::fs::mapped_file_region region_;
+
+public:
+  SpooledPayload(sys::fs::mapped_file_region region, size_t size)
+    : region_(std::move(region)) {
+    init(region_.const_data(), region_.const_data() + size, true);
+  }
+
+  BufferKind getBufferKind() const override { return MemoryBuffer_MMap; }
+};
+
 class LLVMServerSession {
   tcp::socket &socket_;
+  const LLVMServerOptions &options_;
   CompileContext cc_;
   bool running_;
+  // compress the payloads of PARSE, DUMP and CALL
+  bool compress_;
   ByteArray request_payload_;
+  // bytes of a chunked request received but not consumed yet
+  ByteArray chunk_input_;
+  // serializes the requests and the reloads of watched files
+  mutex mutex_;
+  std::unique_ptr<FileWatcher> watcher_;
 
-  void read_payload(size_t total_size) {
-    size_t consumed_size = request_payload_.size();
-    if (request_payload_.capacity() <= total_size) {
-      // ensure there is room for a terminating zero
-      //
-      // contrary to expectations, .resize() changes the capacity of
-      // the vector, not the size
-      request_payload_.resize(total_size + 1);
+  // called on the watcher thread
+  void reload(const string &path) {
+    lock_guard<mutex> lock(mutex_);
+    cerr << "* reloading " << path << endl;
+    try {
+      cc_.watch(path);
     }
+    catch (std::exception &e) {
+      // the file may be saved again in a moment
+      cerr << "* reloading " << path << " failed: " << e.what() << endl;
+    }
+  }
+
+  void read_payload(size_t total_size) {
+    size_t consumed_size = std::min(request_payload_.size(), total_size);
+    // ensure there is room for a terminating zero
+    request_payload_.reserve(total_size + 1);
+    request_payload_.resize_for_overwrite(total_size);
     size_t remaining_size = total_size - consumed_size;
     if (remaining_size > 0) {
-      request_payload_.set_size(total_size); // this changes the size
       asio::read(socket_,
                  asio::buffer(request_payload_.begin() + consumed_size,
                               remaining_size),
@@ -35,6 +77,169 @@ class LLVMServerSession {
     // note that .size() does not count the terminating zero
   }
 
+  // read a payload into a buffer of its own, which is handed over to
+  // the parser and released right after parsing
+  std::unique_ptr<MemoryBuffer> read_payload_buffer(size_t total_size) {
+    char *data;
+    auto buf = payload_buffer(total_size, data);
+    read_payload_into(data, total_size);
+    return buf;
+  }
+
+  void read_payload_into(char *dest, size_t total_size) {
+    size_t consumed_size = std::min(request_payload_.size(), total_size);
+    std::copy(request_payload_.begin(),
+              request_payload_.begin() + consumed_size, dest);
+    request_payload_.erase(request_payload_.begin(),
+                           request_payload_.begin() + consumed_size);
+    size_t remaining_size = total_size - consumed_size;
+    if (remaining_size > 0) {
+      asio::read(socket_,
+                 asio::buffer(dest + consumed_size, remaining_size),
+                 asio::transfer_exactly(remaining_size));
+    }
+  }
+
+  // allocate a buffer for a payload of size bytes, which shall be
+  // written to data
+  //
+  // the memory buffer is null-terminated, as the parser needs it
+  //
+  // large payloads go to a shared mapping of an unlinked temporary
+  // file
+  std::unique_ptr<MemoryBuffer> payload_buffer(size_t size, char *&data) {
+    if (size <= options_.spool_threshold) {
+      auto buf = WritableMemoryBuffer::getNewUninitMemBuffer(size);
+      data = buf->getBufferStart();
+      return std::move(buf);
+    }
+    SmallString<128> path;
+    sys::path::system_temp_directory(true, path);
+    sys::path::append(path, "llvm-server-payload-%%%%%%");
+    int fd;
+    auto ec = sys::fs::createUniqueFile(path, fd, path);
+    if (ec) {
+      throw std::runtime_error("cannot spool payload: " + ec.message());
+    }
+    sys::fs::remove(path);
+    // the file is zero-filled, which provides the terminating zero
+    ec = sys::fs::resize_file(fd, size + 1);
+    std::unique_ptr<sys::fs::mapped_file_region> region;
+    if (!ec) {
+      region = std::make_unique<sys::fs::mapped_file_region>(
+        fd, sys::fs::mapped_file_region::readwrite, size + 1, 0, ec);
+    }
+    ::close(fd);
+    if (ec) {
+      throw std::runtime_error("cannot spool payload: " + ec.message());
+    }
+    data = region->data();
+    return std::make_unique<SpooledPayload>(std::move(*region), size);
+  }
+
+  // a compressed payload consists of the size of the uncompressed
+  // payload on a line of its own, followed by the zlib stream
+  static size_t split_compressed(StringRef &payload) {
+    size_t size;
+    auto eol = payload.find('\n');
+    if (eol == StringRef::npos ||
+        payload.substr(0, eol).getAsInteger(10, size)) {
+      throw std::invalid_argument("invalid compressed payload");
+    }
+    payload = payload.substr(eol + 1);
+    return size;
+  }
+
+  static void uncompress(StringRef payload, char *dest, size_t size) {
+    size_t uncompressed_size = size;
+    if (auto err = zlib::uncompress(payload, dest, uncompressed_size)) {
+      throw std::invalid_argument(toString(std::move(err)));
+    }
+    if (uncompressed_size != size) {
+      throw std::invalid_argument("invalid compressed payload");
+    }
+  }
+
+  // read a compressed payload and uncompress it straight into the
+  // buffer handed over to the parser
+  std::unique_ptr<MemoryBuffer> read_compressed_buffer(size_t total_size) {
+    read_payload(total_size);
+    StringRef payload(request_payload_.begin(), total_size);
+    size_t size = split_compressed(payload);
+    char *data;
+    auto buf = payload_buffer(size, data);
+    uncompress(payload, data, size);
+    return buf;
+  }
+
+  void uncompress_payload() {
+    StringRef payload(request_payload_.begin(), request_payload_.size());
+    size_t size = split_compressed(payload);
+    ByteArray result;
+    result.resize_for_overwrite(size);
+    uncompress(payload, result.begin(), size);
+    request_payload_ = std::move(result);
+  }
+
+  // respond with a payload which is compressed if the session asked
+  // for it
+  void write_result(const ByteArray &payload) {
+    if (!compress_) {
+      write_ok_response(payload);
+      return;
+    }
+    string header = to_string(payload.size()) + "\n";
+    ByteArray compressed;
+    if (auto err = zlib::compress(StringRef(payload.begin(), payload.size()),
+                                  compressed)) {
+      throw std::runtime_error(toString(std::move(err)));
+    }
+    compressed.insert(compressed.begin(), header.begin(), header.end());
+    write_ok_response(compressed);
+  }
+
+  // read the next chunk of a chunked request:
+  //
+  // CHUNK <size>
+  // <size> bytes of data
+  //
+  // returns false at the terminating chunk of zero size
+  bool read_chunk(ByteArray &chunk) {
+    auto eol = std::find(chunk_input_.begin(), chunk_input_.end(), '\n');
+    while (eol == chunk_input_.end()) {
+      char buf[256];
+      size_t n = socket_.read_some(asio::buffer(buf));
+      chunk_input_.append(buf, buf + n);
+      eol = std::find(chunk_input_.begin(), chunk_input_.end(), '\n');
+    }
+    string header(chunk_input_.begin(), eol);
+    chunk_input_.erase(chunk_input_.begin(), eol + 1);
+    vector<string> words;
+    split(words, header, is_any_of(" \t"), token_compress_on);
+    if (words.size() != 2 || words[0] != "CHUNK") {
+      throw std::runtime_error("protocol violation: invalid chunk header");
+    }
+    size_t size;
+    try {
+      size = stoull(words[1]);
+    }
+    catch (std::logic_error &) {
+      throw std::runtime_error("protocol violation: invalid chunk header");
+    }
+    size_t buffered = std::min(size, chunk_input_.size());
+    chunk.resize_for_overwrite(size);
+    std::copy(chunk_input_.begin(), chunk_input_.begin() + buffered,
+              chunk.begin());
+    chunk_input_.erase(chunk_input_.begin(),
+                       chunk_input_.begin() + buffered);
+    if (size > buffered) {
+      asio::read(socket_,
+                 asio::buffer(chunk.begin() + buffered, size - buffered),
+                 asio::transfer_exactly(size - buffered));
+    }
+    return size > 0;
+  }
+
   void write_payload(const ByteArray &payload) {
     asio::write(socket_, asio::buffer(payload.begin(), payload.size()));
   }
@@ -52,6 +257,14 @@ class LLVMServerSession {
     write_payload(payload);
   }
 
+  void write_chunk(const char *data, size_t len) {
+    string header = "CHUNK ";
+    header += to_string(len);
+    header += "\n";
+    asio::write(socket_, asio::buffer(header));
+    asio::write(socket_, asio::buffer(data, len));
+  }
+
   void write_error_response(const char *error_message) {
     int len = strlen(error_message);
     string response = "ERROR ";
@@ -75,10 +288,58 @@ class LLVMServerSession {
     if (command == "parse") {
       size_t payload_size = stoi(words[1]);
       cerr << "PARSE " << payload_size << endl;
-      read_payload(payload_size);
-      cc_.parse(request_payload_);
+      cc_.parse(compress_ ? read_compressed_buffer(payload_size)
+                          : read_payload_buffer(payload_size));
       write_ok_response();
       return payload_size;
+    } else if (command == "parsefile") {
+      string path = words[1];
+      cerr << "PARSEFILE " << path << endl;
+      cc_.parse_file(path);
+      write_ok_response();
+      return 0;
+    } else if (command == "parsemany") {
+      vector<size_t> sizes;
+      size_t payload_size = 0;
+      for (size_t i = 1; i < words.size(); i++) {
+        sizes.push_back(stoull(words[i]));
+        payload_size += sizes.back();
+      }
+      cerr << "PARSEMANY " << algorithm::join(
+        vector<string>(words.begin() + 1, words.end()), " ") << endl;
+      cc_.parse_many(read_payload_buffer(payload_size), sizes);
+      write_ok_response();
+      return payload_size;
+    } else if (command == "have") {
+      string hash = words[1];
+      cerr << "HAVE " << hash << endl;
+      write_ok_response(ByteArray(1, cc_.have(hash) ? '1' : '0'));
+      return 0;
+    } else if (command == "parsehash") {
+      string hash = words[1];
+      size_t payload_size = words.size() > 2 ? stoull(words[2]) : 0;
+      cerr << "PARSEHASH " << hash << " " << payload_size << endl;
+      if (words.size() > 2) {
+        cc_.parse_hash(hash, read_payload_buffer(payload_size));
+      } else {
+        cc_.parse_hash(hash);
+      }
+      write_ok_response();
+      return payload_size;
+    } else if (command == "compress") {
+      string method = words[1];
+      to_lower(method);
+      cerr << "COMPRESS " << method << endl;
+      if (method == "none") {
+        compress_ = false;
+      } else if (method == "zlib" && zlib::isAvailable()) {
+        compress_ = true;
+      } else {
+        throw std::invalid_argument("unsupported compression method: " +
+                                    method);
+      }
+      write_ok_response();
+      return 0;
     } else if (command == "opt") {
       cerr << "OPT" << endl;
       cc_.opt();
@@ -86,12 +347,39 @@ class LLVMServerSession {
       return 0;
     }
     else if (command == "dump") {
+      if (words.size() > 1) {
+        size_t chunk_size = stoull(words[1]);
+        cerr << "DUMP " << chunk_size << endl;
+        cc_.dump(chunk_size, [this](const char *data, size_t len) {
+          write_chunk(data, len);
+        });
+        write_ok_response();
+        return 0;
+      }
       cerr << "DUMP" << endl;
       ByteArray payload = cc_.dump();
-      write_ok_response(payload);
+      write_result(payload);
+      return 0;
+    }
+    else if (command == "dumpfile") {
+      string path = words[1];
+      cerr << "DUMPFILE " << path << endl;
+      cc_.dump_file(path);
+      write_ok_response();
       return 0;
     }
     else if (command == "link") {
+      if (words.size() > 1) {
+        string mode = words[1];
+        to_lower(mode);
+        if (mode != "needed") {
+          throw std::invalid_argument("unsupported link mode: " + mode);
+        }
+        cerr << "LINK NEEDED" << endl;
+        cc_.link(true);
+        write_ok_response();
+        return 0;
+      }
       cerr << "LINK" << endl;
       cc_.link();
       write_ok_response();
@@ -99,18 +387,242 @@ class LLVMServerSession {
     }
     else if (command == "commit") {
       cerr << "COMMIT" << endl;
-      cc_.commit();
-      write_ok_response();
+      string hash = cc_.commit();
+      write_ok_response(ByteArray(hash.begin(), hash.end()));
+      return 0;
+    }
+    else if (command == "replace") {
+      cerr << "REPLACE" << endl;
+      string hash = cc_.replace();
+      write_ok_response(ByteArray(hash.begin(), hash.end()));
+      return 0;
+    }
+    else if (command == "patch") {
+      string hash = words[1];
+      vector<string> removed(words.begin() + 2, words.end());
+      cerr << "PATCH " << hash << " "
+           << algorithm::join(removed, " ") << endl;
+      hash = cc_.patch(hash, removed);
+      write_ok_response(ByteArray(hash.begin(), hash.end()));
+      return 0;
+    }
+    else if (command == "watch") {
+      string path = words[1];
+      cerr << "WATCH " << path << endl;
+      if (!watcher_) {
+        watcher_ = std::make_unique<FileWatcher>([this](const string &path) {
+          reload(path);
+        });
+      }
+      watcher_->add(path);
+      string hash = cc_.watch(path);
+      write_ok_response(ByteArray(hash.begin(), hash.end()));
       return 0;
     }
-    else if (command == "call") {
+    else if (command == "call" || command == "icall") {
       string funcname = words[1];
+      if (!isdigit(words[2][0])) {
+        vector<string> bufnames(words.begin() + 2, words.end());
+        cerr << "CALL " << funcname << " " << algorithm::join(bufnames, " ") << endl;
+        cc_.call(funcname, bufnames);
+        write_ok_response();
+        return 0;
+      }
       size_t bufsize = stoi(words[2]);
-      cerr << "CALL " << funcname << " " << bufsize << endl;
-      ByteArray result = cc_.call(funcname, bufsize);
+      size_t i = 3;
+      size_t payload_size = 0;
+      if (words.size() > i && isdigit(words[i][0])) {
+        payload_size = stoull(words[i++]);
+      }
+      string handle = words.size() > i ? words[i] : "";
+      bool interpret = command == "icall";
+      cerr << (interpret ? "ICALL " : "CALL ") << funcname << " "
+           << bufsize << " " << payload_size << " " << handle << endl;
+      if (payload_size > 0) {
+        read_payload(payload_size);
+        if (compress_) {
+          uncompress_payload();
+        }
+      } else {
+        request_payload_.clear();
+      }
+      ByteArray result = cc_.call(funcname, bufsize,
+                                  request_payload_, handle, interpret);
+      write_result(result);
+      return payload_size;
+    }
+    else if (command == "stream") {
+      string funcname = words[1];
+      size_t chunk_size = stoull(words[2]);
+      cerr << "STREAM " << funcname << " " << chunk_size << endl;
+      cc_.stream(funcname, chunk_size, [this](const char *data, size_t len) {
+        write_chunk(data, len);
+      });
+      write_ok_response();
+      return 0;
+    }
+    else if (command == "feed") {
+      string funcname = words[1];
+      size_t bufsize = stoull(words[2]);
+      cerr << "FEED " << funcname << " " << bufsize << endl;
+      // the chunks may have been read together with the request line
+      size_t excess_size = request_payload_.size();
+      chunk_input_ = request_payload_;
+      bool ended = false;
+      ByteArray result;
+      try {
+        result = cc_.feed(funcname, bufsize, [&](ByteArray &chunk) {
+          ended = !read_chunk(chunk);
+          return !ended;
+        });
+      }
+      catch (std::logic_error &) {
+        // a client error (read_chunk only throws runtime errors): skip
+        // the rest of the stream, so the next request is read from its
+        // start
+        ByteArray chunk;
+        while (!ended) {
+          ended = !read_chunk(chunk);
+        }
+        if (!chunk_input_.empty()) {
+          throw std::runtime_error("protocol violation: excess bytes in the request");
+        }
+        throw;
+      }
+      if (!chunk_input_.empty()) {
+        throw std::runtime_error("protocol violation: excess bytes in the request");
+      }
+      write_ok_response(result);
+      return excess_size;
+    }
+    else if (command == "acall") {
+      string funcname = words[1];
+      size_t bufsize = stoull(words[2]);
+      size_t payload_size = words.size() > 4 ? stoull(words[3]) : 0;
+      string handle = words.back();
+      cerr << "ACALL " << funcname << " " << bufsize << " "
+           << payload_size << " " << handle << endl;
+      if (payload_size > 0) {
+        read_payload(payload_size);
+        if (compress_) {
+          uncompress_payload();
+        }
+      } else {
+        request_payload_.clear();
+      }
+      cc_.async_call(funcname, bufsize, request_payload_, handle);
+      write_ok_response();
+      return payload_size;
+    }
+    else if (command == "await") {
+      string handle = words[1];
+      cerr << "AWAIT " << handle << endl;
+      ByteArray result = cc_.await(handle);
+      write_result(result);
+      return 0;
+    }
+    else if (command == "resume") {
+      string handle = words[1];
+      cerr << "RESUME " << handle << endl;
+      ByteArray result = cc_.resume(handle);
+      write_result(result);
+      return 0;
+    }
+    else if (command == "pure") {
+      string funcname = words[1];
+      cerr << "PURE " << funcname << endl;
+      cc_.pure(funcname);
+      write_ok_response();
+      return 0;
+    }
+    else if (command == "map") {
+      string funcname = words[1];
+      size_t count = stoull(words[2]);
+      size_t in_stride = stoull(words[3]);
+      size_t out_stride = stoull(words[4]);
+      cerr << "MAP " << funcname << " " << count << " "
+           << in_stride << " " << out_stride << endl;
+      size_t limit = std::numeric_limits<size_t>::max();
+      if (count > 0 && (in_stride > limit / count ||
+                        out_stride > limit / count)) {
+        throw std::invalid_argument("count * stride overflows");
+      }
+      size_t payload_size = count * in_stride;
+      read_payload(payload_size);
+      ByteArray result = cc_.map_call(funcname, count,
+                                      in_stride, out_stride,
+                                      request_payload_);
       write_ok_response(result);
+      return payload_size;
+    }
+    else if (command == "graph") {
+      size_t payload_size = stoull(words[1]);
+      vector<string> outputs(words.begin() + 2, words.end());
+      cerr << "GRAPH " << payload_size << " "
+           << algorithm::join(outputs, " ") << endl;
+      read_payload(payload_size);
+      ByteArray result = cc_.graph(request_payload_, outputs);
+      write_ok_response(result);
+      return payload_size;
+    }
+    else if (command == "compose") {
+      string name = words[1];
+      vector<string> funcnames(words.begin() + 2, words.end());
+      cerr << "COMPOSE " << name << " "
+           << algorithm::join(funcnames, " ") << endl;
+      cc_.compose(name, funcnames);
+      write_ok_response();
       return 0;
     }
+    else if (command == "pcall") {
+      string funcname = words[1];
+      string bufname = words[2];
+      size_t chunk_size = stoull(words[3]);
+      size_t result_size = stoull(words[4]);
+      string reduce_funcname = words.size() > 5 ? words[5] : "";
+      cerr << "PCALL " << funcname << " " << bufname << " "
+           << chunk_size << " " << result_size << " "
+           << reduce_funcname << endl;
+      ByteArray result = cc_.pcall(funcname, bufname,
+                                   chunk_size, result_size,
+                                   reduce_funcname);
+      write_ok_response(result);
+      return 0;
+    }
+    else if (command == "alloc") {
+      string name = words[1];
+      size_t size = stoull(words[2]);
+      cerr << "ALLOC " << name << " " << size << endl;
+      cc_.alloc(name, size);
+      write_ok_response();
+      return 0;
+    }
+    else if (command == "free") {
+      string name = words[1];
+      cerr << "FREE " << name << endl;
+      cc_.free(name);
+      write_ok_response();
+      return 0;
+    }
+    else if (command == "read") {
+      string name = words[1];
+      size_t offset = stoull(words[2]);
+      size_t size = stoull(words[3]);
+      cerr << "READ " << name << " " << offset << " " << size << endl;
+      ByteArray result = cc_.read(name, offset, size);
+      write_ok_response(result);
+      return 0;
+    }
+    else if (command == "write") {
+      string name = words[1];
+      size_t offset = stoull(words[2]);
+      size_t payload_size = stoull(words[3]);
+      cerr << "WRITE " << name << " " << offset << " " << payload_size << endl;
+      read_payload(payload_size);
+      cc_.write(name, offset, request_payload_);
+      write_ok_response();
+      return payload_size;
+    }
     else if (command == "import") {
       string path = words[1];
       cerr << "IMPORT " << path << endl;
@@ -129,8 +641,10 @@ class LLVMServerSession {
   }
 
 public:
-  LLVMServerSession(tcp::socket &socket)
-      : socket_(socket), running_(true)
+  LLVMServerSession(tcp::socket &socket, const LLVMServerOptions &options,
+                    const Library *library)
+      : socket_(socket), options_(options), cc_(options.cache_dir, library),
+        running_(true), compress_(false)
     {}
 
   int start() {
@@ -154,6 +668,7 @@ public:
       request_payload_.assign(s.begin() + bytes_read, s.end());
       trim(first_line);
       try {
+        lock_guard<mutex> lock(mutex_);
         size_t consumed_payload_size = process_request(first_line);
         if (s.size() > (bytes_read + consumed_payload_size)) {
           // someone sent too much input
@@ -174,12 +689,21 @@ public:
   }
 };
 
-LLVMServer::LLVMServer(const char *bind_address, int port)
-  : bind_address_(bind_address), port_(port),
+LLVMServer::LLVMServer(const char *bind_address, int port,
+                       const LLVMServerOptions &options)
+  : bind_address_(bind_address), port_(port), options_(options),
     acceptor_(io_context_,
               tcp::endpoint(
                 asio::ip::make_address_v4(bind_address),
-                port)) {}
+                port)) {
+  if (!options_.library_dir.empty()) {
+    library_ = std::make_unique<Library>(options_.library_dir);
+    cerr << "* indexed " << library_->size() << " library symbols in "
+         << options_.library_dir << endl;
+  }
+}
+
+LLVMServer::~LLVMServer() {}
 
 int LLVMServer::start() {
   cerr << "* llvm-server listening on "
@@ -190,7 +714,7 @@ int LLVMServer::start() {
     acceptor_.accept(socket);
     if (fork() == 0) {
       cerr << "* accepted new connection" << endl;
-      LLVMServerSession session(socket);
+      LLVMServerSession session(socket, options_, library_.get());
       int rv = session.start();
       cerr << "* connection closed" << endl;
       return rv;
@@ -1,3 +1,4 @@
+#include <memory>
 #include <string>
 #include <boost/asio.hpp>
 
@@ -5,13 +6,30 @@ using namespace std;
 using namespace boost;
 using boost::asio::ip::tcp;
 
+struct LLVMServerOptions {
+  // PARSE payloads larger than this are spooled to a temporary file
+  size_t spool_threshold = 64 << 20;
+  // PARSEHASH caches the parsed modules here for all sessions
+  string cache_dir;
+  // the modules in this directory define the symbols which committed
+  // modules leave unresolved
+  string library_dir;
+};
+
+class Library;
+
 class LLVMServer {
   string bind_address_;
   int port_;
+  LLVMServerOptions options_;
+  // indexed once, before the sessions are forked
+  std::unique_ptr<Library> library_;
   asio::io_context io_context_;
   tcp::acceptor acceptor_;
 
 public:
-  LLVMServer(const char *bind_address, int port);
+  LLVMServer(const char *bind_address, int port,
+             const LLVMServerOptions &options = LLVMServerOptions());
+  ~LLVMServer();
   int start();
 };
@@ -0,0 +1,201 @@
+#include "threadpool.h"
+
+using namespace std;
+
+// the pool and worker index of the current thread (if it is a worker)
+static thread_local ThreadPool *current_pool = nullptr;
+static thread_local size_t current_index = 0;
+
+ThreadPool::ThreadPool(size_t nthreads)
+  : queued_(0), pending_(0), next_(0), stopping_(false) {
+  if (nthreads == 0) {
+    nthreads = 1;
+  }
+  for (size_t i = 0; i < nthreads; i++) {
+    queues_.push_back(std::make_unique<Queue>());
+  }
+  for (size_t i = 0; i < nthreads; i++) {
+    threads_.emplace_back(&ThreadPool::work, this, i);
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    lock_guard<mutex> lock(m_);
+    stopping_ = true;
+  }
+  work_cv_.notify_all();
+  for (auto &t : threads_) {
+    t.join();
+  }
+}
+
+void ThreadPool::submit(Task task) {
+  size_t index;
+  if (current_pool == this) {
+    // keep work spawned by a task local to its worker
+    index = current_index;
+  } else {
+    lock_guard<mutex> lock(m_);
+    index = next_++ % queues_.size();
+  }
+  {
+    auto &q = *queues_[index];
+    lock_guard<mutex> lock(q.m);
+    q.tasks.push_back(std::move(task));
+  }
+  {
+    lock_guard<mutex> lock(m_);
+    queued_++;
+    pending_++;
+  }
+  work_cv_.notify_one();
+}
+
+bool ThreadPool::take(size_t index, Task &task) {
+  size_t n = queues_.size();
+  for (size_t i = 0; i < n; i++) {
+    auto &q = *queues_[(index + i) % n];
+    lock_guard<mutex> lock(q.m);
+    if (q.tasks.empty()) {
+      continue;
+    }
+    if (i == 0) {
+      task = std::move(q.tasks.back());
+      q.tasks.pop_back();
+    } else {
+      task = std::move(q.tasks.front());
+      q.tasks.pop_front();
+    }
+    lock_guard<mutex> lock2(m_);
+    queued_--;
+    return true;
+  }
+  return false;
+}
+
+void ThreadPool::work(size_t index) {
+  current_pool = this;
+  current_index = index;
+  for (;;) {
+    Task task;
+    if (!take(index, task)) {
+      unique_lock<mutex> lock(m_);
+      work_cv_.wait(lock, [this] { return queued_ > 0 || stopping_; });
+      if (stopping_ && queued_ == 0) {
+        return;
+      }
+      continue;
+    }
+    try {
+      task();
+    }
+    catch (...) {
+      lock_guard<mutex> lock(m_);
+      if (!error_) {
+        error_ = current_exception();
+      }
+    }
+    lock_guard<mutex> lock(m_);
+    if (--pending_ == 0) {
+      idle_cv_.notify_all();
+    }
+  }
+}
+
+void ThreadPool::wait() {
+  unique_lock<mutex> lock(m_);
+  idle_cv_.wait(lock, [this] { return pending_ == 0; });
+  if (error_) {
+    auto error = error_;
+    error_ = nullptr;
+    rethrow_exception(error);
+  }
+}
+
+void ThreadPool::parallel_for(size_t n,
+                              const std::function<void(size_t)> &body) {
+  for (size_t i = 0; i < n; i++) {
+    submit([&body, i] { body(i); });
+  }
+  wait();
+}
+
+Executor::Executor() : stopping_(false) {
+  thread_ = thread(&Executor::work, this);
+}
+
+Executor::~Executor() {
+  {
+    lock_guard<mutex> lock(m_);
+    stopping_ = true;
+  }
+  cv_.notify_all();
+  thread_.join();
+}
+
+void Executor::submit(ThreadPool::Task task) {
+  {
+    lock_guard<mutex> lock(m_);
+    tasks_.push_back(std::move(task));
+  }
+  cv_.notify_all();
+}
+
+void Executor::work() {
+  for (;;) {
+    ThreadPool::Task task;
+    {
+      unique_lock<mutex> lock(m_);
+      cv_.wait(lock, [this] { return !tasks_.empty() || stopping_; });
+      if (tasks_.empty()) {
+        return;
+      }
+      task = std::move(tasks_.front());
+      tasks_.pop_front();
+    }
+    task();
+  }
+}
+
+uint64_t Epochs::enter() {
+  lock_guard<mutex> lock(m_);
+  readers_[epoch_]++;
+  return epoch_;
+}
+
+void Epochs::leave(uint64_t epoch) {
+  lock_guard<mutex> lock(m_);
+  auto it = readers_.find(epoch);
+  if (--it->second == 0) {
+    readers_.erase(it);
+  }
+}
+
+void Epochs::retire(Release release) {
+  lock_guard<mutex> lock(m_);
+  retired_.push_back({ epoch_, std::move(release) });
+  epoch_++;
+}
+
+void Epochs::collect() {
+  vector<Release> releases;
+  {
+    lock_guard<mutex> lock(m_);
+    // readers of later epochs entered after the retirement
+    while (!retired_.empty() &&
+           (readers_.empty() ||
+            retired_.front().first < readers_.begin()->first)) {
+      releases.push_back(std::move(retired_.front().second));
+      retired_.pop_front();
+    }
+  }
+  for (auto &release : releases) {
+    release();
+  }
+}
+
+size_t Epochs::pending() {
+  lock_guard<mutex> lock(m_);
+  return retired_.size();
+}
@@ -0,0 +1,135 @@
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+// a work-stealing thread pool
+//
+// each worker owns a deque of tasks: it takes work from the back of
+// its own deque and steals from the front of the others' when it runs
+// out of work
+class ThreadPool {
+public:
+  using Task = std::function<void()>;
+
+private:
+  struct Queue {
+    mutex m;
+    deque<Task> tasks;
+  };
+
+  vector<std::unique_ptr<Queue>> queues_;
+  vector<thread> threads_;
+  mutex m_;
+  condition_variable work_cv_;
+  condition_variable idle_cv_;
+  size_t queued_;
+  size_t pending_;
+  size_t next_;
+  bool stopping_;
+  exception_ptr error_;
+
+  bool take(size_t index, Task &task);
+  void work(size_t index);
+
+public:
+  explicit ThreadPool(size_t nthreads = thread::hardware_concurrency());
+  ~ThreadPool();
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+  size_t size() const { return threads_.size(); }
+
+  // tasks may submit further tasks
+  void submit(Task task);
+
+  // wait until all submitted tasks have finished
+  //
+  // rethrows the first exception thrown by a task
+  //
+  // must not be called from a task
+  void wait();
+
+  // run body(0) ... body(n-1) on the pool and wait for all of them
+  void parallel_for(size_t n, const std::function<void(size_t)> &body);
+};
+
+// runs tasks one at a time on a thread of its own, in the order of
+// submission
+class Executor {
+  thread thread_;
+  mutex m_;
+  condition_variable cv_;
+  deque<ThreadPool::Task> tasks_;
+  bool stopping_;
+
+  void work();
+
+public:
+  Executor();
+  // runs the remaining tasks before returning
+  ~Executor();
+  Executor(const Executor &) = delete;
+  Executor &operator=(const Executor &) = delete;
+
+  void submit(ThreadPool::Task task);
+};
+
+// epoch-based reclamation
+//
+// a reader enters the current epoch while it may use shared objects,
+// and an object retired by a writer is released only after every
+// reader which entered before the retirement has left (the grace
+// period)
+class Epochs {
+public:
+  using Release = std::function<void()>;
+
+  // a reader for the lifetime of the guard
+  class Guard {
+    Epochs &epochs_;
+    uint64_t epoch_;
+
+  public:
+    explicit Guard(Epochs &epochs)
+      : epochs_(epochs), epoch_(epochs.enter()) {}
+    ~Guard() { epochs_.leave(epoch_); }
+    Guard(const Guard &) = delete;
+    Guard &operator=(const Guard &) = delete;
+  };
+
+private:
+  mutex m_;
+  uint64_t epoch_;
+  // the number of readers in each epoch
+  map<uint64_t, size_t> readers_;
+  // the retired objects in order of retirement, with their epochs
+  deque<pair<uint64_t, Release>> retired_;
+
+public:
+  Epochs() : epoch_(0) {}
+  Epochs(const Epochs &) = delete;
+  Epochs &operator=(const Epochs &) = delete;
+
+  uint64_t enter();
+  void leave(uint64_t epoch);
+
+  // release will be called by collect() after the grace period
+  void retire(Release release);
+
+  // call the releases whose grace period is over
+  //
+  // readers only leave, so the releases run on the thread of the
+  // writer
+  void collect();
+
+  // the number of retired objects not released yet
+  size_t pending();
+};
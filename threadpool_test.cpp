@@ -0,0 +1,75 @@
+#include "doctest.h"
+#include "threadpool.h"
+
+TEST_CASE("ThreadPool") {
+  ThreadPool pool(4);
+  CHECK(pool.size() == 4);
+  SUBCASE("parallel_for") {
+    vector<int> squares(1000);
+    pool.parallel_for(squares.size(), [&](size_t i) {
+      squares[i] = i * i;
+    });
+    for (size_t i = 0; i < squares.size(); i++) {
+      CHECK(squares[i] == i * i);
+    }
+  }
+  SUBCASE("tasks submitting tasks") {
+    mutex m;
+    int count = 0;
+    for (int i = 0; i < 10; i++) {
+      pool.submit([&] {
+        for (int j = 0; j < 10; j++) {
+          pool.submit([&] {
+            lock_guard<mutex> lock(m);
+            count++;
+          });
+        }
+      });
+    }
+    pool.wait();
+    CHECK(count == 100);
+  }
+  SUBCASE("exceptions") {
+    CHECK_THROWS_AS(pool.parallel_for(10, [](size_t i) {
+      if (i == 5) {
+        throw std::invalid_argument("boom");
+      }
+    }), std::invalid_argument);
+    // the pool is still usable
+    pool.parallel_for(10, [](size_t i) {});
+  }
+}
+
+TEST_CASE("Executor") {
+  vector<int> order;
+  {
+    Executor executor;
+    for (int i = 0; i < 100; i++) {
+      executor.submit([&order, i] { order.push_back(i); });
+    }
+  }
+  CHECK(order.size() == 100);
+  for (int i = 0; i < 100; i++) {
+    CHECK(order[i] == i);
+  }
+}
+
+TEST_CASE("Epochs") {
+  Epochs epochs;
+  int released = 0;
+  auto old_reader = epochs.enter();
+  epochs.retire([&] { released++; });
+  {
+    Epochs::Guard new_reader(epochs);
+    epochs.collect();
+    CHECK(released == 0);
+    epochs.leave(old_reader);
+    epochs.collect();
+    CHECK(released == 1);
+  }
+  epochs.retire([&] { released++; });
+  CHECK(epochs.pending() == 1);
+  epochs.collect();
+  CHECK(released == 2);
+  CHECK(epochs.pending() == 0);
+}
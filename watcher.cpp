@@ -0,0 +1,90 @@
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <set>
+#include <stdexcept>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include "watcher.h"
+
+using namespace std;
+
+FileWatcher::FileWatcher(Callback on_change)
+  : on_change_(std::move(on_change)) {
+  fd_ = inotify_init1(IN_CLOEXEC);
+  if (fd_ < 0) {
+    throw std::runtime_error(string("inotify_init1: ") + strerror(errno));
+  }
+  if (pipe(stop_pipe_) < 0) {
+    close(fd_);
+    throw std::runtime_error(string("pipe: ") + strerror(errno));
+  }
+  thread_ = thread(&FileWatcher::work, this);
+}
+
+FileWatcher::~FileWatcher() {
+  char stop = 0;
+  while (write(stop_pipe_[1], &stop, 1) < 0 && errno == EINTR) {
+  }
+  thread_.join();
+  close(stop_pipe_[0]);
+  close(stop_pipe_[1]);
+  close(fd_);
+}
+
+void FileWatcher::add(const string &path) {
+  auto slash = path.rfind('/');
+  string dir = slash == string::npos ? "." : path.substr(0, slash + 1);
+  string name = slash == string::npos ? path : path.substr(slash + 1);
+  if (name.empty()) {
+    throw std::invalid_argument("not a file: " + path);
+  }
+  int wd = inotify_add_watch(fd_, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+  if (wd < 0) {
+    throw std::invalid_argument("cannot watch " + path + ": " +
+                                strerror(errno));
+  }
+  lock_guard<mutex> lock(m_);
+  paths_[{ wd, name }] = path;
+}
+
+void FileWatcher::work() {
+  // inotify_event is followed by the file name
+  alignas(inotify_event) char buf[4096 + sizeof(inotify_event) + NAME_MAX + 1];
+  for (;;) {
+    pollfd fds[2] = { { fd_, POLLIN, 0 }, { stop_pipe_[0], POLLIN, 0 } };
+    if (poll(fds, 2, -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return;
+    }
+    if (fds[1].revents) {
+      return;
+    }
+    ssize_t len = read(fd_, buf, sizeof(buf));
+    if (len <= 0) {
+      continue;
+    }
+    // several events for the same file are reported once
+    set<string> changed;
+    {
+      lock_guard<mutex> lock(m_);
+      for (char *p = buf; p < buf + len;) {
+        auto event = reinterpret_cast<inotify_event *>(p);
+        if (event->len > 0) {
+          auto it = paths_.find({ event->wd, event->name });
+          if (it != paths_.end()) {
+            changed.insert(it->second);
+          }
+        }
+        p += sizeof(inotify_event) + event->len;
+      }
+    }
+    for (auto &path : changed) {
+      on_change_(path);
+    }
+  }
+}
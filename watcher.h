@@ -0,0 +1,38 @@
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+
+using namespace std;
+
+// watches files for changes with inotify on a thread of its own
+//
+// the directories of the files are watched, so files replaced by a
+// rename (as many editors save) are noticed too
+class FileWatcher {
+public:
+  using Callback = std::function<void(const string &path)>;
+
+private:
+  Callback on_change_;
+  int fd_;
+  // written to stop the thread
+  int stop_pipe_[2];
+  mutex m_;
+  // watched paths by watch descriptor and file name
+  map<pair<int, string>, string> paths_;
+  thread thread_;
+
+  void work();
+
+public:
+  // on_change is called on the watcher thread with the path of a file
+  // which has been written
+  explicit FileWatcher(Callback on_change);
+  ~FileWatcher();
+  FileWatcher(const FileWatcher &) = delete;
+  FileWatcher &operator=(const FileWatcher &) = delete;
+
+  void add(const string &path);
+};
@@ -0,0 +1,42 @@
+#include <chrono>
+#include <condition_variable>
+#include <fstream>
+#include <vector>
+#include <unistd.h>
+
+#include "doctest.h"
+#include "watcher.h"
+
+TEST_CASE("FileWatcher") {
+  char dir[] = "/tmp/watcher_test.XXXXXX";
+  REQUIRE(mkdtemp(dir));
+  string path = string(dir) + "/watched.ll";
+  mutex m;
+  condition_variable cv;
+  vector<string> changes;
+  FileWatcher watcher([&](const string &changed) {
+    lock_guard<mutex> lock(m);
+    changes.push_back(changed);
+    cv.notify_all();
+  });
+  watcher.add(path);
+  auto wait_for_change = [&] {
+    unique_lock<mutex> lock(m);
+    return cv.wait_for(lock, chrono::seconds(5),
+                       [&] { return !changes.empty(); });
+  };
+  SUBCASE("written") {
+    ofstream(path) << "; written\n";
+    REQUIRE(wait_for_change());
+    CHECK(changes[0] == path);
+  }
+  SUBCASE("replaced by a rename") {
+    string tmp = string(dir) + "/watched.ll.tmp";
+    ofstream(tmp) << "; renamed\n";
+    rename(tmp.c_str(), path.c_str());
+    REQUIRE(wait_for_change());
+    CHECK(changes[0] == path);
+  }
+  unlink(path.c_str());
+  rmdir(dir);
+}